@@ -0,0 +1,53 @@
+// ROM container written by subleqasm and loaded by the VM, all fields
+// little-endian:
+//   RomHeader, then section_count RomSection entries, then section data.
+// Sections load at a multiple of 64 bits. Raw sections start at an 8-byte
+// aligned file offset and are copied to memory as is, LZ sections are
+// LZ4-style blocks decompressed in place. Memory not covered by a section
+// is zero. Files without the magic are flat bit streams loaded at 0.
+#ifndef ROM_FORMAT_H_
+#define ROM_FORMAT_H_
+
+#include <cstdint>
+
+const char kRomMagic[8] = {'S', 'U', 'B', 'L', 'E', 'Q', 'R', 'M'};
+const uint32_t kRomVersion = 1;
+const uint32_t kSectionRaw = 0;
+const uint32_t kSectionLz = 1;
+
+struct RomHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t ram_bits;
+  uint32_t word_bits;
+  uint64_t entry_ip;
+  uint64_t screen_bits[2];
+  uint32_t section_count;
+  uint32_t reserved;
+};
+
+struct RomSection {
+  uint64_t load_bits;
+  uint64_t file_offset;
+  uint64_t stored_size;
+  uint64_t size;
+  uint32_t encoding;
+  uint32_t reserved;
+};
+
+// Address and word bits the VM has an interpreter for.
+struct RomConfig {
+  uint32_t ram_bits;
+  uint32_t word_bits;
+};
+
+constexpr RomConfig kRomConfigs[] = {
+  {16, 32},
+  {20, 52},
+  {22, 52},
+  {24, 52},
+  {26, 52},
+};
+
+#endif  // ROM_FORMAT_H_
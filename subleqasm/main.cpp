@@ -1,6 +1,10 @@
+#include <algorithm>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <string_view>
 #include <string>
 #include <unordered_map>
@@ -8,6 +12,8 @@
 #include <vector>
 #include <sstream>
 
+#include "rom_format.h"
+
 struct Word {
   int64_t source_line;
   bool is_immediate = false;
@@ -40,9 +46,61 @@ int64_t code_size_bits = 0;
 std::vector<Macro> macros;
 Macro* macro_being_parsed = nullptr;
 int64_t next_macro_substitution_idx = 0;
+int64_t subleq_count = 0;
+
+// Annotated listing, collected only when requested.
+struct ListingLine {
+  std::string text;
+  int64_t source_line;
+  int64_t depth;  // macro nesting
+  int64_t offset_bits;
+  size_t code_begin;
+  size_t code_end = 0;
+  int64_t subleqs = 0;
+};
+
+struct MacroStats {
+  int64_t calls = 0;
+  int64_t subleqs = 0;  // including nested macros
+  int64_t size_bits = 0;
+};
+
+bool listing_enabled = false;
+std::vector<ListingLine> listing;
+int64_t listing_depth = 0;
+std::vector<MacroStats> macro_stats;
 
 bool parseLine(std::string_view line, int64_t line_number, std::unordered_map<std::string, Word> &substitutions, bool is_macro); 
 
+void BeginListingLine(std::string_view line, int64_t line_number) {
+  listing.emplace_back();
+  ListingLine &entry = listing.back();
+  entry.text = std::string(line);
+  entry.source_line = line_number;
+  entry.depth = listing_depth;
+  entry.offset_bits = code_size_bits;
+  entry.code_begin = code.size();
+  entry.subleqs = subleq_count;
+}
+
+void EndListingLine(size_t idx) {
+  listing[idx].code_end = code.size();
+  listing[idx].subleqs = subleq_count - listing[idx].subleqs;
+}
+
+bool parseListedLine(std::string_view line, int64_t line_number, std::unordered_map<std::string, Word> &substitutions, bool is_macro) {
+  if (!listing_enabled) {
+    return parseLine(line, line_number, substitutions, is_macro);
+  }
+  size_t idx = listing.size();
+  BeginListingLine(line, line_number);
+  ++listing_depth;
+  bool is_ok = parseLine(line, line_number, substitutions, is_macro);
+  --listing_depth;
+  EndListingLine(idx);
+  return is_ok;
+}
+
 
 void PushCode(Word &word, int64_t size_bits) {
   code.push_back(word);
@@ -225,6 +283,7 @@ bool parseSubleqInstruction(std::string_view& text, int64_t line_number, std::un
     PushCode(word[0], 26);
     PushCode(word[1], 26);
     PushCode(word[2], 26);
+    ++subleq_count;
   } else {
     std::cerr << "Error: Can't parse instruction arguments at line " << line_number << std::endl;
   }
@@ -442,15 +501,24 @@ bool substituteMacro(std::string_view& text, int64_t line_number, std::string& n
     substitutions[*it] = word;
   }
 
+  int64_t subleqs_before = subleq_count;
+  int64_t size_before = code_size_bits;
   for (size_t i = 0; i < macro.lines.size(); ++i) {
     MacroLine &macro_line = macro.lines[i];
     std::string_view v = macro_line.text;
-    if (!parseLine(v, macro_line.source_line, substitutions, true)) {
+    if (!parseListedLine(v, macro_line.source_line, substitutions, true)) {
       std::cerr << "Error: Could not parse line " << macro_line.source_line << std::endl;
       std::cerr << "Error: Could not substitute macro at line " << line_number << std::endl;
       return false;
     }
   }
+  if (listing_enabled) {
+    macro_stats.resize(macros.size());
+    MacroStats &stats = macro_stats[macro_id];
+    ++stats.calls;
+    stats.subleqs += subleq_count - subleqs_before;
+    stats.size_bits += code_size_bits - size_before;
+  }
 
   return true;
 }
@@ -550,7 +618,7 @@ bool CheckAddr() {
 
 class BitwiseOutput {
 	public:
-		explicit BitwiseOutput(std::ofstream &outputStream)
+		explicit BitwiseOutput(std::ostream &outputStream)
 			: out(outputStream), buffer(0), bufferBits(0) {}
 
 		~BitwiseOutput() {
@@ -581,37 +649,312 @@ class BitwiseOutput {
 		}
 
 	private:
-		std::ofstream &out;
+		std::ostream &out;
 		uint8_t buffer;
 		size_t bufferBits;
 };
 
+uint64_t WordValue(const Word &word) {
+  return word.is_immediate ?
+    word.immediate :
+    (static_cast<uint64_t>(symbol_to_addr[word.symbol_id]) + word.immediate);
+}
+
 void EmitBinaryCode(BitwiseOutput &out) {
   for (size_t idx = 0; idx < code.size(); ++idx) {
     const auto& word = code[idx];
-    uint64_t data = word.is_immediate ?
-      word.immediate :
-      (static_cast<uint64_t>(symbol_to_addr[word.symbol_id]) + word.immediate);
-    out.write(data, word.size_bits);
+    out.write(WordValue(word), word.size_bits);
+  }
+}
+
+// Macros ranked by the SUBLEQ instructions all their calls emit, nested
+// macros included.
+void EmitMacroSummary(std::ostream &out) {
+  std::vector<std::pair<std::string, int64_t>> names;
+  for (const auto& it : symbol_map) {
+    if (it.second < 0 && -1 - it.second < static_cast<int64_t>(macro_stats.size())) {
+      names.emplace_back(it.first, -1 - it.second);
+    }
+  }
+  std::sort(names.begin(), names.end(), [](const auto& a, const auto& b) {
+    const MacroStats &sa = macro_stats[a.second];
+    const MacroStats &sb = macro_stats[b.second];
+    if (sa.subleqs != sb.subleqs) {
+      return sa.subleqs > sb.subleqs;
+    }
+    return a.first < b.first;
+  });
+  out << ";       macro  calls  subleq  size_bits  subleq/call\n";
+  char text[256];
+  for (const auto& name : names) {
+    const MacroStats &stats = macro_stats[name.second];
+    if (!stats.calls) {
+      continue;
+    }
+    snprintf(text, sizeof(text), "; %11s %6lld %7lld %10lld %12.1f\n",
+        name.first.c_str(), static_cast<long long>(stats.calls),
+        static_cast<long long>(stats.subleqs),
+        static_cast<long long>(stats.size_bits),
+        static_cast<double>(stats.subleqs) / stats.calls);
+    out << text;
+  }
+  snprintf(text, sizeof(text), "; total %lld subleq, %lld bits\n",
+      static_cast<long long>(subleq_count),
+      static_cast<long long>(code_size_bits));
+  out << text;
+}
+
+// One line per source line, macro expansions indented below their calls:
+// bit address, SUBLEQ instructions, source line number, text and the words
+// it emitted itself.
+void EmitListing(std::ostream &out) {
+  const size_t kMaxWordsShown = 8;
+  out << ";   offset  subleq   line  source\n";
+  char text[256];
+  for (size_t idx = 0; idx < listing.size(); ++idx) {
+    const ListingLine &entry = listing[idx];
+    std::string source(entry.depth * 2, ' ');
+    source += entry.text.substr(entry.text.find_first_not_of(" \t") == std::string::npos ?
+        entry.text.size() : entry.text.find_first_not_of(" \t"));
+    size_t words = entry.code_end - entry.code_begin;
+    snprintf(text, sizeof(text), words ? "%10lld %7lld %6lld  %-48s" : "%10lld %7lld %6lld  %s",
+        static_cast<long long>(entry.offset_bits),
+        static_cast<long long>(entry.subleqs),
+        static_cast<long long>(entry.source_line), source.c_str());
+    out << text;
+    bool is_call = idx + 1 < listing.size() && listing[idx + 1].depth > entry.depth;
+    if (is_call) {
+      out << " ; " << words << " words";
+    } else if (words) {
+      out << " ;";
+      for (size_t i = 0; i < words && i < kMaxWordsShown; ++i) {
+        const Word &word = code[entry.code_begin + i];
+        const uint64_t mask = word.size_bits < 64 ?
+          (1ULL << word.size_bits) - 1 : ~0ULL;
+        out << " " << (WordValue(word) & mask);
+      }
+      if (words > kMaxWordsShown) {
+        out << " ... " << words << " words";
+      }
+    }
+    out << "\n";
+  }
+  EmitMacroSummary(out);
+}
+
+// Writes "NAME address" for every defined label, ordered by address.
+void EmitSymbols(std::ofstream &out) {
+  std::vector<std::pair<int64_t, std::string>> symbols;
+  for (const auto& it : symbol_map) {
+    if (it.second >= 0 && symbol_to_addr[it.second] >= 0) {
+      symbols.emplace_back(symbol_to_addr[it.second], it.first);
+    }
+  }
+  std::sort(symbols.begin(), symbols.end());
+  for (const auto& symbol : symbols) {
+    out << symbol.second << " " << symbol.first << "\n";
+  }
+}
+
+// Sequences of a token (literal count << 4 | match length - 4), literals,
+// a 16-bit match offset and the match; counts of 15 continue in the bytes
+// that follow, 255 at a time. The last sequence has literals only.
+std::string CompressLz(const std::string_view in) {
+  const size_t kMinMatch = 4;
+  const size_t kHashBits = 14;
+  std::vector<int64_t> table(1 << kHashBits, -1);
+  std::string out;
+  auto hash = [&in](size_t pos) {
+    uint32_t v = static_cast<uint8_t>(in[pos]) | (static_cast<uint8_t>(in[pos + 1]) << 8) |
+      (static_cast<uint8_t>(in[pos + 2]) << 16) | (static_cast<uint32_t>(static_cast<uint8_t>(in[pos + 3])) << 24);
+    return (v * 2654435761u) >> (32 - kHashBits);
+  };
+  auto put_count = [&out](size_t count) {
+    while (count >= 255) {
+      out.push_back(static_cast<char>(255));
+      count -= 255;
+    }
+    out.push_back(static_cast<char>(count));
+  };
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + kMinMatch <= in.size()) {
+    size_t h = hash(pos);
+    int64_t candidate = table[h];
+    table[h] = static_cast<int64_t>(pos);
+    if (candidate < 0 || pos - candidate > 65535 ||
+        in.compare(candidate, kMinMatch, in.substr(pos, kMinMatch)) != 0) {
+      ++pos;
+      continue;
+    }
+    size_t length = kMinMatch;
+    while (pos + length < in.size() && in[candidate + length] == in[pos + length]) {
+      ++length;
+    }
+    size_t literals = pos - anchor;
+    size_t match = length - kMinMatch;
+    out.push_back(static_cast<char>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(match, 15)));
+    if (literals >= 15) {
+      put_count(literals - 15);
+    }
+    out.append(in.substr(anchor, literals));
+    size_t offset = pos - candidate;
+    out.push_back(static_cast<char>(offset & 255));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (match >= 15) {
+      put_count(match - 15);
+    }
+    pos += length;
+    anchor = pos;
+  }
+  size_t literals = in.size() - anchor;
+  out.push_back(static_cast<char>(std::min<size_t>(literals, 15) << 4));
+  if (literals >= 15) {
+    put_count(literals - 15);
+  }
+  out.append(in.substr(anchor));
+  return out;
+}
+
+// Splits the image into sections at runs of at least kMinGap zero qwords
+// and leaves the zeros out. A section is stored compressed when that saves
+// at least an eighth of it.
+void EmitRom(std::ofstream &out, std::string image, uint32_t ram_bits,
+    uint64_t entry_ip, const uint64_t screen_bits[2]) {
+  const size_t kMinGap = 64;
+  image.resize((image.size() + 7) & ~size_t(7), 0);
+  auto is_zero = [&image](size_t qword) {
+    for (size_t i = 0; i < 8; ++i) {
+      if (image[qword * 8 + i]) {
+        return false;
+      }
+    }
+    return true;
+  };
+  std::vector<std::pair<size_t, size_t>> ranges;  // qwords
+  size_t qwords = image.size() / 8;
+  size_t qword = 0;
+  while (qword < qwords) {
+    while (qword < qwords && is_zero(qword)) {
+      ++qword;
+    }
+    if (qword == qwords) {
+      break;
+    }
+    size_t begin = qword;
+    size_t end = qword;
+    while (qword < qwords && qword - end < kMinGap) {
+      if (!is_zero(qword)) {
+        end = qword + 1;
+      }
+      ++qword;
+    }
+    ranges.emplace_back(begin, end);
+  }
+
+  RomHeader header = {};
+  std::copy(kRomMagic, kRomMagic + 8, header.magic);
+  header.version = kRomVersion;
+  header.header_size = sizeof(RomHeader);
+  header.ram_bits = ram_bits;
+  header.word_bits = 52;
+  header.entry_ip = entry_ip;
+  header.screen_bits[0] = screen_bits[0];
+  header.screen_bits[1] = screen_bits[1];
+  header.section_count = static_cast<uint32_t>(ranges.size());
+
+  std::vector<RomSection> sections;
+  std::vector<std::string> data;
+  uint64_t offset = sizeof(RomHeader) + ranges.size() * sizeof(RomSection);
+  for (const auto& range : ranges) {
+    std::string_view raw = std::string_view(image).substr(range.first * 8,
+        (range.second - range.first) * 8);
+    std::string packed = CompressLz(raw);
+    RomSection section = {};
+    section.load_bits = range.first * 64;
+    section.size = raw.size();
+    if (packed.size() < raw.size() - raw.size() / 8) {
+      section.encoding = kSectionLz;
+      data.push_back(std::move(packed));
+    } else {
+      section.encoding = kSectionRaw;
+      data.emplace_back(raw);
+    }
+    offset = (offset + 7) & ~uint64_t(7);
+    section.file_offset = offset;
+    section.stored_size = data.back().size();
+    offset += section.stored_size;
+    sections.push_back(section);
   }
+
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(RomSection));
+  uint64_t written = sizeof(RomHeader) + sections.size() * sizeof(RomSection);
+  for (size_t i = 0; i < sections.size(); ++i) {
+    for (; written < sections[i].file_offset; ++written) {
+      out.put(0);
+    }
+    out.write(data[i].data(), data[i].size());
+    written += data[i].size();
+  }
+}
+
+int64_t LabelAddr(const std::string& name, int64_t default_addr) {
+  auto it = symbol_map.find(name);
+  if (it == symbol_map.end() || it->second < 0 || symbol_to_addr[it->second] < 0) {
+    return default_addr;
+  }
+  return symbol_to_addr[it->second];
+}
+
+// Words are 52 bits wide, so only the 52-bit configurations of the VM fit.
+bool IsRamBitsSupported(uint32_t ram_bits) {
+  for (const RomConfig& config : kRomConfigs) {
+    if (config.ram_bits == ram_bits && config.word_bits == 52) {
+      return true;
+    }
+  }
+  return false;
 }
 
 int main(int argc, char* argv[]) {
-  if (argc < 3) {
-    std::cout << "Usage: sbuleqasm <input file> <output file>" << std::endl;
+  std::vector<const char*> files;
+  const char* listing_file = nullptr;
+  bool is_flat = false;
+  uint32_t ram_bits = 22;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string_view(argv[i]) == "--listing" && i + 1 < argc) {
+      listing_file = argv[++i];
+    } else if (std::string_view(argv[i]) == "--flat") {
+      is_flat = true;
+    } else if (std::string_view(argv[i]) == "--ram-bits" && i + 1 < argc) {
+      char* end = nullptr;
+      const unsigned long value = std::strtoul(argv[++i], &end, 10);
+      ram_bits = (*end == '\0') ? static_cast<uint32_t>(value) : 0;
+      if (!IsRamBitsSupported(ram_bits)) {
+        std::cerr << "Error: --ram-bits must be one of";
+        for (const RomConfig& config : kRomConfigs) {
+          if (config.word_bits == 52) {
+            std::cerr << " " << config.ram_bits;
+          }
+        }
+        std::cerr << "." << std::endl;
+        return 1;
+      }
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+  if (files.size() < 2) {
+    std::cout << "Usage: sbuleqasm <input file> <output file> [<symbol file>] [--listing <listing file>] [--flat] [--ram-bits <bits>]" << std::endl;
     return 1;
   }
-  std::ifstream in(argv[1]);
+  listing_enabled = (listing_file != nullptr);
+  std::ifstream in(files[0]);
   if (!in) {
     std::cerr << "Error: Could not open input file." << std::endl;
     return 1;
   }
-  std::ofstream out(argv[2], std::ios::binary);
-  if (!out) {
-    std::cerr << "Error: Could not open output file." << std::endl;
-    return 1;
-  }
-
   int64_t line_number = 0;
   while(!in.eof()) {
     ++line_number;
@@ -622,11 +965,15 @@ int main(int argc, char* argv[]) {
     std::string_view v = line;
     std::unordered_map<std::string, Word> substitutions;
     if (!macro_being_parsed) {
-      if (!parseLine(v, line_number, substitutions, false)) {
+      if (!parseListedLine(v, line_number, substitutions, false)) {
         std::cerr << "Error: Could not parse line " << line_number << std::endl;
         return 1;
       }
     } else {
+      if (listing_enabled) {
+        BeginListingLine(v, line_number);
+        EndListingLine(listing.size() - 1);
+      }
       if (!parseMacroLine(v, line_number)) {
         std::cerr << "Error: Could not parse macro line " << line_number << std::endl;
         return 1;
@@ -638,8 +985,52 @@ int main(int argc, char* argv[]) {
     std::cerr << "Error: Could not emit binary code" << std::endl;
     return 1;
   }
-	BitwiseOutput bitwiseOut(out);
+  std::ostringstream image;
+	BitwiseOutput bitwiseOut(image);
   EmitBinaryCode(bitwiseOut);
   bitwiseOut.flushBuffer();
+  // The ROM is written next to the output and renamed over it at the end,
+  // so a VM watching the output never sees a half-written file.
+  const std::string temp_file = std::string(files[1]) + ".tmp";
+  std::ofstream out(temp_file, std::ios::binary);
+  if (!out) {
+    std::cerr << "Error: Could not open output file." << std::endl;
+    return 1;
+  }
+  if (is_flat) {
+    out << image.str();
+  } else {
+    // Execution starts at ENTRY, 0 by default. The VM shows screens at
+    // SCREEN_0 and SCREEN_1, 0 and 936 * 936 by default.
+    const uint64_t screen_bits[2] = {
+        static_cast<uint64_t>(LabelAddr("SCREEN_0", 0)),
+        static_cast<uint64_t>(LabelAddr("SCREEN_1", 936 * 936))};
+    EmitRom(out, image.str(), ram_bits,
+        static_cast<uint64_t>(LabelAddr("ENTRY", 0)), screen_bits);
+  }
+  out.close();
+  if (!out || (std::rename(temp_file.c_str(), files[1]) != 0 &&
+      (std::remove(files[1]), std::rename(temp_file.c_str(), files[1]) != 0))) {
+    std::remove(temp_file.c_str());
+    std::cerr << "Error: Could not write output file." << std::endl;
+    return 1;
+  }
+  if (files.size() > 2) {
+    std::ofstream symbols(files[2]);
+    if (!symbols) {
+      std::cerr << "Error: Could not open symbol file." << std::endl;
+      return 1;
+    }
+    EmitSymbols(symbols);
+  }
+  if (listing_enabled) {
+    std::ofstream listing_out(listing_file);
+    if (!listing_out) {
+      std::cerr << "Error: Could not open listing file." << std::endl;
+      return 1;
+    }
+    EmitListing(listing_out);
+    EmitMacroSummary(std::cout);
+  }
   return 0;
 }
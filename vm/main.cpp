@@ -1,5 +1,26 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <future>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
 #include "engine/easy.h"
 #include "engine/unicode.h"
+#include "rom_format.h"
 using namespace arctic;
 using std::string;
 
@@ -10,39 +31,35 @@ const Rgba g_black{0, 0, 0, 255};
 Vec2Si32 g_screen_size(936, 936);
 Vec2Si32 g_screen_pos[2] = {Vec2Si32(12,120), Vec2Si32(972,120)};
 
-#define RAM_BITS 22
-#define RAM_SIZE_BITS (1<<RAM_BITS)
-#define RAM_MASK_BITS (RAM_SIZE_BITS-1)
-#define RAM_SIZE_BYTES (RAM_SIZE_BITS>>3)
-#define RAM_MASK_BYTES (RAM_SIZE_BYTES-1)
-#define RAM_SIZE_QW (RAM_SIZE_BITS>>6)
-#define RAM_MASK_QW (RAM_SIZE_QW-1)
-
-Ui64 ip_register;
-Ui64 ram[RAM_SIZE_QW+3];
-
+#define DEFAULT_RAM_BITS 22
+#define DEFAULT_WORD_BITS 52
 
 Font g_font;
 
-inline void Write52(Ui64 * const mem, const Ui64 bitOffset, const Ui64 value) {
+// The interpreter core is specialized for the address width (log2 of the
+// memory size in bits) and the word width. Operands are half a word wide,
+// an instruction is three operands.
+template <Ui32 kWordBits>
+inline void WriteWord(Ui64 * const mem, const Ui64 bitOffset, const Ui64 value) {
   const Ui64 elementIndex = bitOffset >> 6;
   const Ui64 startBit = bitOffset & 63;
-  if (startBit > 12) {
+  if (startBit > 64 - kWordBits) {
     const Ui64 bitsInCurrentElement = 64 - startBit;
-    const Ui64 bitsInNextElement = 52 - bitsInCurrentElement;
+    const Ui64 bitsInNextElement = kWordBits - bitsInCurrentElement;
     const Ui64 currentElementMask = (1ULL << bitsInCurrentElement) - 1;
     const Ui64 nextElementMask = (1ULL << bitsInNextElement) - 1;
     mem[elementIndex] = (mem[elementIndex] & ~(currentElementMask << startBit)) | (value << startBit);
     mem[elementIndex+1] = (mem[elementIndex+1] & ~nextElementMask) | (value >> bitsInCurrentElement);
   } else {
-    mem[elementIndex] = (mem[elementIndex] & ~(((1ULL << 52) - 1) << startBit)) | (value << startBit);
+    mem[elementIndex] = (mem[elementIndex] & ~(((1ULL << kWordBits) - 1) << startBit)) | (value << startBit);
   }
 }
 
-inline void Xor52(Ui64 * const mem, const Ui64 bitOffset, const Ui64 value) {
+template <Ui32 kWordBits>
+inline void XorWord(Ui64 * const mem, const Ui64 bitOffset, const Ui64 value) {
   const Ui64 elementIndex = bitOffset >> 6;
   const Ui64 startBit = bitOffset & 63;
-  if (startBit > 12) {
+  if (startBit > 64 - kWordBits) {
     const Ui64 bitsInCurrentElement = 64 - startBit;
     mem[elementIndex] ^= (value << startBit);
     mem[elementIndex+1] ^= (value >> bitsInCurrentElement);
@@ -51,38 +68,2020 @@ inline void Xor52(Ui64 * const mem, const Ui64 bitOffset, const Ui64 value) {
   }
 }
 
-inline constexpr Ui64 Read52(const Ui64 * const mem, const Ui64 offset) {
+template <Ui32 kWordBits>
+inline constexpr Ui64 ReadWord(const Ui64 * const mem, const Ui64 offset) {
   const Ui64 start_index = offset >> 6;
   const Ui64 start_bit = offset & 63;
   const Ui64 value = (mem[start_index] >> start_bit);
   const Ui64 next_value = start_bit ? mem[start_index + 1] << (64-start_bit) : 0;
-  return (value | next_value) & 0x000FFFFFFFFFFFFF;
+  return (value | next_value) & ((1ULL << kWordBits) - 1);
 }
 
+template <Ui32 kAddrBits>
 inline constexpr Ui64 ReadRambits(const Ui64 * const mem, const Ui64 offset) {
   const Ui64 start_index = offset >> 6;
   const Ui64 start_bit = offset & 63;
   const Ui64 value = (mem[start_index] >> start_bit);
   const Ui64 next_value = start_bit ? mem[start_index + 1] << (64-start_bit) : 0;
-  return (value | next_value) & RAM_MASK_BITS;
+  return (value | next_value) & ((1ULL << kAddrBits) - 1);
 }
 
+template <Ui32 kAddrBits, Ui32 kWordBits>
 inline Ui64 InterpretOne(Ui64 * const mem, const Ui64 ip) {
-  const Ui64 v = Read52(mem, ip);
-  const Ui64 a = v & RAM_MASK_BITS;
-  const Ui64 b = (v >> 26) & RAM_MASK_BITS;
-  const Ui64 va = Read52(mem, a);
-  const Ui64 vb = Read52(mem, b);
-  const Ui64 res = (va - vb) & 0x000FFFFFFFFFFFFF;
-  Xor52(mem, a, res ^ va);
-  if (res - 1 < ((1ull<<51) - 1)) {
-    return (ip + 3 * 26) & RAM_MASK_BITS;
+  static_assert(kAddrBits <= kWordBits / 2 && kWordBits < 64,
+      "Addresses must fit in an operand");
+  const Ui64 ram_mask = (1ULL << kAddrBits) - 1;
+  const Ui64 v = ReadWord<kWordBits>(mem, ip);
+  const Ui64 a = v & ram_mask;
+  const Ui64 b = (v >> (kWordBits / 2)) & ram_mask;
+  const Ui64 va = ReadWord<kWordBits>(mem, a);
+  const Ui64 vb = ReadWord<kWordBits>(mem, b);
+  const Ui64 res = (va - vb) & ((1ULL << kWordBits) - 1);
+  XorWord<kWordBits>(mem, a, res ^ va);
+  if (res - 1 < ((1ULL << (kWordBits - 1)) - 1)) {
+    return (ip + 3 * (kWordBits / 2)) & ram_mask;
   } else {
-    const Ui64 next_ip = ReadRambits(mem, (ip + 52) );
+    const Ui64 next_ip = ReadRambits<kAddrBits>(mem, (ip + kWordBits) );
     return next_ip;
   }
 }
 
+// Run loop observers. BeforeStep is called before every interpreted
+// instruction and stops the loop by returning false, OnStep after it.
+// OnBulk follows every bulk execution, which only happens if kAllowBulk.
+struct NullObserver {
+  static constexpr bool kAllowBulk = true;
+  bool BeforeStep(const Ui64 * const, const Ui64) { return true; }
+  void OnStep(const Ui64, const Ui64) {}
+  void OnBulk(const Ui64, const Ui64) {}
+};
+
+// Loop acceleration.
+//
+// Memset/memcpy-style loops (a counter decremented to zero, pointers moved by
+// a constant stride and memory accessed through patched instruction operands)
+// are recognized at the target of a hot backward jump. One iteration of the
+// body is executed symbolically: every value is either affine in the
+// iteration number i (base + i * slope, modulo the word size) or opaque, that is
+// loaded from memory through a moving pointer. When the body maps the state
+// of iteration i onto the state of iteration i + 1 and no two accesses can
+// alias, the iterations that follow the same path are executed in bulk:
+// only the memory operations that touch opaque values are replayed, every
+// other cell gets its closed form value at the end.
+template <Ui32 kAddrBits, Ui32 kWordBits>
+class LoopAccelerator {
+ public:
+  LoopAccelerator() {
+    Reset();
+  }
+
+  void Reset() {
+    for (Head &head : heads_) {
+      head.heat = 0;
+      head.backoff = kMinBackoff;
+    }
+    bulk_instructions_ = 0;
+  }
+
+  // Executes exactly count instructions starting at ip, returns the new ip.
+  Ui64 Run(Ui64 * const mem, const Ui64 ip, const Ui64 count) {
+    NullObserver observer;
+    return Run(mem, ip, count, observer);
+  }
+
+  // Same, reporting to the observer. Stops early if the observer says so.
+  template <class Observer>
+  Ui64 Run(Ui64 * const mem, Ui64 ip, const Ui64 count, Observer &observer) {
+    Ui64 left = count;
+    while (left && observer.BeforeStep(mem, ip)) {
+      const Ui64 next_ip = InterpretOne<kAddrBits, kWordBits>(mem, ip);
+      --left;
+      observer.OnStep(ip, next_ip);
+      if (Observer::kAllowBulk && next_ip <= ip) {
+        Head &head = heads_[(next_ip ^ (next_ip >> 10)) & (kHeatSize - 1)];
+        if (++head.heat >= kHotThreshold) {
+          const Ui64 done = TryBulk(mem, next_ip, left);
+          left -= done;
+          if (done) {
+            head.heat = kHotThreshold - 1;
+            head.backoff = kMinBackoff;
+            observer.OnBulk(next_ip, done);
+          } else {
+            head.heat = -head.backoff;
+            head.backoff = head.backoff < kMaxBackoff / 2 ?
+              head.backoff * 2 : kMaxBackoff;
+          }
+        }
+      }
+      ip = next_ip;
+    }
+    return ip;
+  }
+
+  // The number of instructions retired by bulk execution so far.
+  Ui64 BulkInstructions() const {
+    return bulk_instructions_;
+  }
+
+ private:
+  static constexpr Ui32 kFieldBits = kWordBits / 2;
+  static constexpr Ui64 kRamMask = (1ULL << kAddrBits) - 1;
+  static constexpr Ui64 kWordMask = (1ULL << kWordBits) - 1;
+  static constexpr Ui64 kFieldMask = (1ULL << kFieldBits) - 1;
+  static constexpr Ui64 kSignBit = 1ULL << (kWordBits - 1);
+  static constexpr Si32 kHeatSize = 1024;
+  static constexpr Si32 kHotThreshold = 2;
+  static constexpr Si32 kMinBackoff = 64;
+  static constexpr Si32 kMaxBackoff = 1 << 20;
+  static constexpr Ui64 kMaxBodySteps = 1024;
+  static constexpr Ui64 kMinIterations = 8;
+  static constexpr Ui64 kUnlimited = ~0ull;
+
+  // A word, affine in the iteration number modulo 2^kWordBits.
+  struct Value {
+    Ui64 base = 0;
+    Ui64 slope = 0;
+    bool is_affine = true;
+
+    Value() {}
+    Value(Ui64 in_base, Ui64 in_slope)
+        : base(in_base & kWordMask)
+        , slope(in_slope & kWordMask) {
+    }
+    static Value Opaque() {
+      Value v;
+      v.is_affine = false;
+      return v;
+    }
+    Ui64 At(Ui64 i) const {
+      return (base + i * slope) & kWordMask;
+    }
+  };
+
+  // An operand field, half a word wide. Affine fields are exact integers:
+  // the iteration count is limited so that they never leave the field.
+  struct Field {
+    Si64 base = 0;
+    Si64 slope = 0;
+    bool is_affine = true;
+  };
+
+  // A field at a fixed address accessed by the loop body.
+  struct Cell {
+    Ui64 addr;
+    Field start;
+    Field value;
+    bool is_written;
+  };
+
+  // A memory address that moves by a constant stride every iteration.
+  struct Stream {
+    Ui64 addr;
+    Si64 stride;
+    bool is_written;
+  };
+
+  // Operand of a replayed operation: memory or an affine value.
+  struct Operand {
+    bool is_mem = false;
+    Ui64 addr = 0;
+    Si64 stride = 0;
+    Value value;
+  };
+
+  struct Interval {
+    Ui64 lo;
+    Ui64 hi;
+    bool is_written;
+    Ui64 addr;
+    Si64 stride;
+  };
+
+  // A backward jump target. After every failed analysis the head cools
+  // down for twice as many jumps as before, so loops that never qualify
+  // cost next to nothing.
+  struct Head {
+    Si32 heat;
+    Si32 backoff;
+  };
+
+  enum OpKind {
+    kOpGeneric = 0,
+    kOpStore,  // dst = constant, kept in rhs
+    kOpSubtract  // dst -= constant
+  };
+
+  // dst = lhs - rhs, replayed once per iteration.
+  struct Op {
+    Ui64 dst;
+    Si64 dst_stride;
+    Operand lhs;
+    Operand rhs;
+    OpKind kind;
+  };
+
+  // Maps cell addresses to positions in a cell vector. Cleared in O(1).
+  class CellIndex {
+   public:
+    static constexpr Ui32 kNone = ~0u;
+
+    CellIndex() {
+      for (Ui32 &stamp : stamp_) {
+        stamp = 0;
+      }
+    }
+
+    void Clear() {
+      if (++generation_ == 0) {
+        for (Ui32 &stamp : stamp_) {
+          stamp = 0;
+        }
+        generation_ = 1;
+      }
+    }
+
+    Ui32 Find(const Ui64 addr) const {
+      for (Ui32 slot = Hash(addr); stamp_[slot] == generation_;
+          slot = (slot + 1) & (kSize - 1)) {
+        if (key_[slot] == addr) {
+          return value_[slot];
+        }
+      }
+      return kNone;
+    }
+
+    void Insert(const Ui64 addr, const Ui32 value) {
+      Ui32 slot = Hash(addr);
+      while (stamp_[slot] == generation_) {
+        slot = (slot + 1) & (kSize - 1);
+      }
+      stamp_[slot] = generation_;
+      key_[slot] = addr;
+      value_[slot] = value;
+    }
+
+   private:
+    static constexpr Ui32 kSize = 16384;
+
+    static Ui32 Hash(const Ui64 addr) {
+      return static_cast<Ui32>((addr * 0x9E3779B97F4A7C15ull) >> 50);
+    }
+
+    Ui64 key_[kSize];
+    Ui32 value_[kSize];
+    Ui32 stamp_[kSize];
+    Ui32 generation_ = 1;
+  };
+
+  static Si64 SignExtend(Ui64 value, Ui32 bits) {
+    const Ui64 sign = 1ull << (bits - 1);
+    return static_cast<Si64>((value ^ sign) - sign);
+  }
+
+  // The number of iterations i >= 0 for which start + i * step stays in
+  // [lo, hi], given that start is in range.
+  static Ui64 IterationsInRange(Si64 start, Si64 step, Si64 lo, Si64 hi) {
+    if (step > 0) {
+      return static_cast<Ui64>((hi - start) / step) + 1;
+    } else if (step < 0) {
+      return static_cast<Ui64>((start - lo) / -step) + 1;
+    }
+    return kUnlimited;
+  }
+
+  static void WriteField(Ui64 * const mem, const Ui64 addr, const Ui64 value) {
+    WriteWord<kWordBits>(mem, addr,
+        (ReadWord<kWordBits>(mem, addr) & ~kFieldMask) | value);
+  }
+
+  // Concrete dry run of one iteration over a field overlay of memory.
+  // Records the path and the per-iteration delta of every field it touches.
+  // Fields at overlapping offsets make the overlay inaccurate, but such
+  // loops are rejected by IsAliasFree anyway.
+  bool DryRun(const Ui64 * const mem, const Ui64 head, const Ui64 max_steps) {
+    path_.clear();
+    dry_cells_.clear();
+    dry_cells_.reserve(7 * kMaxBodySteps);
+    dry_index_.Clear();
+    Ui64 ip = head;
+    do {
+      if (path_.size() == max_steps) {
+        return false;
+      }
+      path_.push_back(ip);
+      const Ui64 a = DryCell(mem, ip).value.base & kRamMask;
+      const Ui64 b = DryCell(mem, ip + kFieldBits).value.base & kRamMask;
+      const Ui64 va = DryWord(mem, a);
+      const Ui64 vb = DryWord(mem, b);
+      const Ui64 res = (va - vb) & kWordMask;
+      DryCell(mem, a).value.base = static_cast<Si64>(res & kFieldMask);
+      DryCell(mem, a + kFieldBits).value.base = static_cast<Si64>(res >> kFieldBits);
+      const Ui64 target = DryCell(mem, ip + kWordBits).value.base & kRamMask;
+      if (res - 1 < (kSignBit - 1)) {
+        ip = (ip + 3 * kFieldBits) & kRamMask;
+      } else {
+        ip = target;
+      }
+    } while (ip != head);
+    for (Cell &cell : dry_cells_) {
+      cell.start.slope = SignExtend(
+          static_cast<Ui64>(cell.value.base - cell.start.base) & kFieldMask, kFieldBits);
+    }
+    return true;
+  }
+
+  Cell &DryCell(const Ui64 * const mem, const Ui64 addr) {
+    const Ui32 idx = dry_index_.Find(addr);
+    if (idx != CellIndex::kNone) {
+      return dry_cells_[idx];
+    }
+    Cell cell;
+    cell.addr = addr;
+    cell.start.base = static_cast<Si64>(ReadWord<kWordBits>(mem, addr) & kFieldMask);
+    cell.value = cell.start;
+    cell.is_written = false;
+    dry_index_.Insert(addr, static_cast<Ui32>(dry_cells_.size()));
+    dry_cells_.push_back(cell);
+    return dry_cells_.back();
+  }
+
+  Ui64 DryWord(const Ui64 * const mem, const Ui64 addr) {
+    const Ui64 lo = static_cast<Ui64>(DryCell(mem, addr).value.base);
+    const Ui64 hi = static_cast<Ui64>(DryCell(mem, addr + kFieldBits).value.base);
+    return lo | (hi << kFieldBits);
+  }
+
+  bool IsOpaqueAtStart(const Ui64 addr) const {
+    return std::find(opaque_cells_.begin(), opaque_cells_.end(), addr) !=
+      opaque_cells_.end();
+  }
+
+  void Constrain(const Field &field, const Si64 hi) {
+    if (field.is_affine && field.slope != 0) {
+      iterations_ = std::min(iterations_,
+          IterationsInRange(field.base, field.slope, 0, hi));
+    }
+  }
+
+  Cell *SymbolicCell(const Ui64 * const mem, const Ui64 addr) {
+    const Ui32 idx = cell_index_.Find(addr);
+    if (idx != CellIndex::kNone) {
+      return &cells_[idx];
+    }
+    const Ui32 dry_idx = dry_index_.Find(addr);
+    if (dry_idx == CellIndex::kNone) {
+      return nullptr;
+    }
+    Cell cell;
+    cell.addr = addr;
+    if (IsOpaqueAtStart(addr)) {
+      cell.start.is_affine = false;
+    } else {
+      cell.start.base = static_cast<Si64>(ReadWord<kWordBits>(mem, addr) & kFieldMask);
+      cell.start.slope = dry_cells_[dry_idx].start.slope;
+      Constrain(cell.start, kFieldMask);
+    }
+    cell.value = cell.start;
+    cell.is_written = false;
+    cell_index_.Insert(addr, static_cast<Ui32>(cells_.size()));
+    cells_.push_back(cell);
+    return &cells_.back();
+  }
+
+  // Reads the word at a fixed address. Fails when only one of its fields
+  // is opaque, since the memory holds a stale value for the other one.
+  bool ReadCellWord(const Ui64 * const mem, const Ui64 addr, Value *out_value) {
+    Cell *lo = SymbolicCell(mem, addr);
+    Cell *hi = SymbolicCell(mem, addr + kFieldBits);
+    if (!lo || !hi || lo->value.is_affine != hi->value.is_affine) {
+      return false;
+    }
+    if (!lo->value.is_affine) {
+      *out_value = Value::Opaque();
+      return true;
+    }
+    *out_value = Value(
+        static_cast<Ui64>(lo->value.base) + (static_cast<Ui64>(hi->value.base) << kFieldBits),
+        static_cast<Ui64>(lo->value.slope) + (static_cast<Ui64>(hi->value.slope) << kFieldBits));
+    return true;
+  }
+
+  void WriteCellWord(Cell *lo, Cell *hi, const Value &value) {
+    lo->is_written = true;
+    hi->is_written = true;
+    if (!value.is_affine) {
+      lo->value.is_affine = false;
+      hi->value.is_affine = false;
+      return;
+    }
+    const Si64 slope_lo = SignExtend(value.slope & kFieldMask, kFieldBits);
+    lo->value.is_affine = true;
+    lo->value.base = static_cast<Si64>(value.base & kFieldMask);
+    lo->value.slope = slope_lo;
+    hi->value.is_affine = true;
+    hi->value.base = static_cast<Si64>(value.base >> kFieldBits);
+    hi->value.slope = SignExtend(
+        ((value.slope - static_cast<Ui64>(slope_lo)) & kWordMask) >> kFieldBits, kFieldBits);
+    Constrain(lo->value, kFieldMask);
+    Constrain(hi->value, kFieldMask);
+  }
+
+  void AddStream(const Ui64 addr, const Si64 stride, const bool is_written) {
+    for (Stream &stream : streams_) {
+      if (stream.addr == addr && stream.stride == stride) {
+        stream.is_written |= is_written;
+        return;
+      }
+    }
+    streams_.push_back(Stream{addr, stride, is_written});
+  }
+
+  void AddOp(const Ui64 dst, const Si64 dst_stride, const Operand &lhs,
+      const Operand &rhs) {
+    Op op{dst, dst_stride, lhs, rhs, kOpGeneric};
+    const bool is_constant_rhs = !rhs.is_mem && rhs.value.slope == 0;
+    if (!lhs.is_mem && lhs.value.slope == 0 && is_constant_rhs) {
+      op.kind = kOpStore;
+      op.rhs.value = Value(lhs.value.base - rhs.value.base, 0);
+    } else if (lhs.is_mem && lhs.addr == dst && lhs.stride == dst_stride &&
+        is_constant_rhs) {
+      op.kind = kOpSubtract;
+    }
+    ops_.push_back(op);
+  }
+
+  // Symbolic execution of one iteration along the recorded path. Fills
+  // cells_, streams_ and ops_ and limits iterations_ by the exit tests and
+  // by the ranges of the fields.
+  bool SymbolicRun(const Ui64 * const mem) {
+    cells_.clear();
+    cells_.reserve(7 * kMaxBodySteps);
+    cell_index_.Clear();
+    streams_.clear();
+    ops_.clear();
+    for (size_t step = 0; step < path_.size(); ++step) {
+      const Ui64 ip = path_[step];
+      const Ui64 next_on_path = path_[(step + 1) % path_.size()];
+      Operand operand[2];
+      Cell *target_cell[2] = {nullptr, nullptr};
+      for (Si32 k = 0; k < 2; ++k) {
+        const Cell *code = SymbolicCell(mem, ip + kFieldBits * k);
+        if (!code || !code->value.is_affine) {
+          return false;
+        }
+        const Field field = code->value;
+        operand[k].is_mem = true;
+        if (field.slope == 0) {
+          operand[k].addr = static_cast<Ui64>(field.base) & kRamMask;
+          if (!ReadCellWord(mem, operand[k].addr, &operand[k].value)) {
+            return false;
+          }
+          operand[k].is_mem = !operand[k].value.is_affine;
+          target_cell[k] = SymbolicCell(mem, operand[k].addr);
+        } else {
+          const Si64 min_stride = kWordBits;
+          if (field.base > static_cast<Si64>(kRamMask) ||
+              std::abs(field.slope) < min_stride) {
+            return false;
+          }
+          operand[k].addr = static_cast<Ui64>(field.base);
+          operand[k].stride = field.slope;
+          iterations_ = std::min(iterations_,
+              IterationsInRange(field.base, field.slope, 0, kRamMask));
+        }
+      }
+      const Cell *branch = SymbolicCell(mem, ip + kWordBits);
+      if (!branch || !branch->value.is_affine || branch->value.slope != 0) {
+        return false;
+      }
+
+      Value res;
+      if (operand[0].addr == operand[1].addr &&
+          operand[0].stride == operand[1].stride) {
+        res = Value(0, 0);
+        operand[0].is_mem = false;
+        operand[0].value = res;
+        operand[1] = operand[0];
+      } else if (!operand[0].is_mem && !operand[1].is_mem) {
+        res = Value(operand[0].value.base - operand[1].value.base,
+            operand[0].value.slope - operand[1].value.slope);
+      } else {
+        res = Value::Opaque();
+      }
+
+      if (operand[0].stride == 0) {
+        WriteCellWord(target_cell[0], SymbolicCell(mem, operand[0].addr + kFieldBits), res);
+        if (!res.is_affine) {
+          AddOp(operand[0].addr, 0, operand[0], operand[1]);
+        }
+      } else {
+        AddStream(operand[0].addr, operand[0].stride, true);
+        AddOp(operand[0].addr, operand[0].stride, operand[0], operand[1]);
+      }
+      if (operand[1].stride != 0) {
+        AddStream(operand[1].addr, operand[1].stride, false);
+      }
+
+      // Follow the recorded branch direction.
+      const Ui64 fall_through = (ip + 3 * kFieldBits) & kRamMask;
+      const Ui64 target = static_cast<Ui64>(branch->value.base) & kRamMask;
+      if (target == fall_through) {
+        if (next_on_path != fall_through) {
+          return false;
+        }
+        continue;
+      }
+      if (!res.is_affine) {
+        return false;
+      }
+      const bool is_positive = (res.base - 1 < (kSignBit - 1));
+      if (next_on_path != (is_positive ? fall_through : target)) {
+        return false;
+      }
+      if (res.slope != 0) {
+        const Si64 start = SignExtend(res.base, kWordBits);
+        const Si64 step_value = SignExtend(res.slope, kWordBits);
+        const Si64 half = static_cast<Si64>(kSignBit);
+        iterations_ = std::min(iterations_, is_positive ?
+            IterationsInRange(start, step_value, 1, half - 1) :
+            IterationsInRange(start, step_value, -half, 0));
+      }
+    }
+    return true;
+  }
+
+  // Checks that the symbolic state at the end of the body is the state at
+  // the start of the next iteration. Fields that end opaque are collected in
+  // opaque_cells_ for the next round.
+  bool IsConsistent(bool *out_is_stable) {
+    *out_is_stable = true;
+    for (const Cell &cell : cells_) {
+      if (!cell.value.is_affine) {
+        if (cell.start.is_affine) {
+          opaque_cells_.push_back(cell.addr);
+          *out_is_stable = false;
+        }
+        continue;
+      }
+      if (!cell.start.is_affine ||
+          cell.value.base != cell.start.base + cell.start.slope ||
+          cell.value.slope != cell.start.slope) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Streams moving by the same stride never meet when their offsets differ
+  // by at least one word modulo the stride, as in unrolled inner loops.
+  static bool IsInterleaved(const Interval &x, const Interval &y) {
+    if (x.stride == 0 || x.stride != y.stride) {
+      return false;
+    }
+    const Ui64 stride = static_cast<Ui64>(x.stride < 0 ? -x.stride : x.stride);
+    const Ui64 offset = (x.addr > y.addr ? x.addr - y.addr : y.addr - x.addr) % stride;
+    return offset >= kWordBits && offset <= stride - kWordBits;
+  }
+
+  // Any two overlapping accesses where at least one of them is a write make
+  // the bulk execution unsafe. Cells are accessed in all iterations, streams
+  // cover the whole range they move over.
+  bool IsAliasFree() {
+    intervals_.clear();
+    for (const Cell &cell : cells_) {
+      intervals_.push_back(Interval{cell.addr, cell.addr + kFieldBits, cell.is_written,
+          cell.addr, 0});
+    }
+    for (const Stream &stream : streams_) {
+      const Si64 last = static_cast<Si64>(stream.addr) +
+        static_cast<Si64>(iterations_ - 1) * stream.stride;
+      const Ui64 lo = static_cast<Ui64>(std::min(static_cast<Si64>(stream.addr), last));
+      const Ui64 hi = static_cast<Ui64>(std::max(static_cast<Si64>(stream.addr), last)) + kWordBits;
+      intervals_.push_back(Interval{lo, hi, stream.is_written,
+          stream.addr, stream.stride});
+    }
+    std::sort(intervals_.begin(), intervals_.end(),
+        [](const Interval &x, const Interval &y) { return x.lo < y.lo; });
+    for (size_t i = 0; i < intervals_.size(); ++i) {
+      for (size_t j = i + 1;
+          j < intervals_.size() && intervals_[j].lo < intervals_[i].hi; ++j) {
+        if ((intervals_[i].is_written || intervals_[j].is_written) &&
+            !IsInterleaved(intervals_[i], intervals_[j])) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  static Ui64 Evaluate(const Ui64 * const mem, const Operand &operand,
+      const Ui64 i) {
+    if (operand.is_mem) {
+      return ReadWord<kWordBits>(mem,
+          operand.addr + static_cast<Ui64>(operand.stride) * i);
+    }
+    return operand.value.At(i);
+  }
+
+  void Replay(Ui64 * const mem) const {
+    for (Ui64 i = 0; i < iterations_; ++i) {
+      for (const Op &op : ops_) {
+        const Ui64 dst = op.dst + static_cast<Ui64>(op.dst_stride) * i;
+        switch (op.kind) {
+          case kOpStore:
+            WriteWord<kWordBits>(mem, dst, op.rhs.value.base);
+            break;
+          case kOpSubtract:
+            WriteWord<kWordBits>(mem, dst,
+                (ReadWord<kWordBits>(mem, dst) - op.rhs.value.base) & kWordMask);
+            break;
+          default:
+            WriteWord<kWordBits>(mem, dst,
+                (Evaluate(mem, op.lhs, i) - Evaluate(mem, op.rhs, i)) & kWordMask);
+            break;
+        }
+      }
+    }
+  }
+
+  // Tries to execute as many iterations of the loop at head as possible
+  // within budget instructions. Returns the number of instructions retired.
+  Ui64 TryBulk(Ui64 * const mem, const Ui64 head, const Ui64 budget) {
+    if (!DryRun(mem, head,
+          std::min(budget / kMinIterations, static_cast<Ui64>(kMaxBodySteps)))) {
+      return 0;
+    }
+    opaque_cells_.clear();
+    bool is_stable = false;
+    for (Si32 round = 0; !is_stable; ++round) {
+      iterations_ = budget / path_.size();
+      if (round == 4 || !SymbolicRun(mem) || !IsConsistent(&is_stable)) {
+        return 0;
+      }
+    }
+    if (iterations_ < kMinIterations || !IsAliasFree()) {
+      return 0;
+    }
+
+    Replay(mem);
+    const Si64 last = static_cast<Si64>(iterations_ - 1);
+    for (const Cell &cell : cells_) {
+      if (cell.is_written && cell.value.is_affine) {
+        WriteField(mem, cell.addr,
+            static_cast<Ui64>(cell.value.base + last * cell.value.slope));
+      }
+    }
+    const Ui64 done = iterations_ * path_.size();
+    bulk_instructions_ += done;
+    return done;
+  }
+
+  Head heads_[kHeatSize];
+  Ui64 bulk_instructions_ = 0;
+  Ui64 iterations_ = 0;
+  std::vector<Ui64> path_;
+  std::vector<Cell> dry_cells_;
+  std::vector<Cell> cells_;
+  CellIndex dry_index_;
+  CellIndex cell_index_;
+  std::vector<Stream> streams_;
+  std::vector<Op> ops_;
+  std::vector<Ui64> opaque_cells_;
+  std::vector<Interval> intervals_;
+};
+
+Ui64 ReadBits(const Ui64 * const mem, const Ui64 offset, const Ui32 width) {
+  const Ui64 value = mem[offset >> 6] >> (offset & 63);
+  const Ui64 next_value = (offset & 63) ? mem[(offset >> 6) + 1] << (64 - (offset & 63)) : 0;
+  return (value | next_value) & ((1ull << width) - 1);
+}
+
+void WriteBits(Ui64 * const mem, const Ui64 offset, const Ui32 width,
+    const Ui64 value) {
+  for (Ui32 i = 0; i < width; ++i) {
+    const Ui64 bit = offset + i;
+    const Ui64 mask = 1ull << (bit & 63);
+    mem[bit >> 6] = ((value >> i) & 1) ? (mem[bit >> 6] | mask) :
+      (mem[bit >> 6] & ~mask);
+  }
+}
+
+// Breakpoints on instruction addresses and watchpoints on bit ranges. The
+// machine runs the instrumented loop with it only while something is armed,
+// without bulk execution, so that every instruction is seen.
+class Debugger {
+ public:
+  static constexpr bool kAllowBulk = false;
+
+  enum StopReason {
+    kStopNone = 0,
+    kStopBreakpoint,
+    kStopWatchpoint
+  };
+
+  struct Watchpoint {
+    Ui64 begin;
+    Ui64 end;
+  };
+
+  Debugger(const Ui32 addr_bits, const Ui32 word_bits)
+      : addr_bits_(addr_bits)
+      , word_bits_(word_bits) {
+  }
+
+  bool IsArmed() const {
+    return !breakpoints_.empty() || !watchpoints_.empty();
+  }
+
+  void AddBreakpoint(const Ui64 ip) {
+    auto it = std::lower_bound(breakpoints_.begin(), breakpoints_.end(), ip);
+    if (it == breakpoints_.end() || *it != ip) {
+      breakpoints_.insert(it, ip);
+    }
+  }
+
+  bool RemoveBreakpoint(const Ui64 ip) {
+    auto it = std::lower_bound(breakpoints_.begin(), breakpoints_.end(), ip);
+    if (it == breakpoints_.end() || *it != ip) {
+      return false;
+    }
+    breakpoints_.erase(it);
+    return true;
+  }
+
+  // Stops after any instruction that writes to bits [begin, end).
+  void AddWatchpoint(const Ui64 begin, const Ui64 end) {
+    watchpoints_.push_back(Watchpoint{begin, end});
+  }
+
+  bool RemoveWatchpoint(const Ui64 begin) {
+    for (auto it = watchpoints_.begin(); it != watchpoints_.end(); ++it) {
+      if (it->begin == begin) {
+        watchpoints_.erase(it);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const std::vector<Ui64> &Breakpoints() const {
+    return breakpoints_;
+  }
+
+  const std::vector<Watchpoint> &Watchpoints() const {
+    return watchpoints_;
+  }
+
+  // Clears the stop; the breakpoint at the first instruction is skipped so
+  // that execution can continue from it.
+  void Resume() {
+    stop_reason_ = kStopNone;
+    is_first_step_ = true;
+  }
+
+  StopReason Reason() const {
+    return stop_reason_;
+  }
+
+  // The instruction that triggered the watchpoint and the address it wrote.
+  Ui64 WriterIp() const {
+    return writer_ip_;
+  }
+
+  Ui64 WrittenAddr() const {
+    return written_addr_;
+  }
+
+  Ui64 Executed() const {
+    return executed_;
+  }
+
+  bool BeforeStep(const Ui64 * const mem, const Ui64 ip) {
+    if (stop_reason_ != kStopNone) {
+      return false;
+    }
+    if (!is_first_step_ &&
+        std::binary_search(breakpoints_.begin(), breakpoints_.end(), ip)) {
+      stop_reason_ = kStopBreakpoint;
+      return false;
+    }
+    is_first_step_ = false;
+    step_ip_ = ip;
+    step_addr_ = ReadBits(mem, ip, addr_bits_);
+    return true;
+  }
+
+  void OnStep(const Ui64, const Ui64) {
+    ++executed_;
+    for (const Watchpoint &watchpoint : watchpoints_) {
+      if (step_addr_ < watchpoint.end &&
+          step_addr_ + word_bits_ > watchpoint.begin) {
+        stop_reason_ = kStopWatchpoint;
+        writer_ip_ = step_ip_;
+        written_addr_ = step_addr_;
+      }
+    }
+  }
+
+  void OnBulk(const Ui64, const Ui64) {
+  }
+
+ private:
+  Ui32 addr_bits_;
+  Ui32 word_bits_;
+  std::vector<Ui64> breakpoints_;  // sorted
+  std::vector<Watchpoint> watchpoints_;
+  StopReason stop_reason_ = kStopNone;
+  bool is_first_step_ = false;
+  Ui64 step_ip_ = 0;
+  Ui64 step_addr_ = 0;
+  Ui64 writer_ip_ = 0;
+  Ui64 written_addr_ = 0;
+  Ui64 executed_ = 0;
+};
+
+// Counts memory reads and writes per bucket of bucket_bits bits. It sees
+// the accesses InterpretOne makes: the instruction word, both operands, the
+// written word and the jump target when the instruction jumps. An access
+// that spans two buckets counts in both. Also keeps a log2 histogram of the
+// distances between consecutive accesses. Runs without bulk execution.
+class Heatmap {
+ public:
+  static constexpr bool kAllowBulk = false;
+  static constexpr Si32 kDistanceBins = 64;
+
+  Heatmap(const Ui32 addr_bits, const Ui32 word_bits, const Ui64 bucket_bits)
+      : addr_bits_(addr_bits)
+      , word_bits_(word_bits)
+      , bucket_bits_(bucket_bits) {
+    // The jump target read of an instruction at the last address ends
+    // word_bits + addr_bits past the end of memory.
+    const Ui64 buckets = ((1ull << addr_bits) + word_bits + addr_bits) /
+      bucket_bits + 1;
+    reads_.assign(buckets, 0);
+    writes_.assign(buckets, 0);
+    for (Ui64 &count : distances_) {
+      count = 0;
+    }
+  }
+
+  bool BeforeStep(const Ui64 * const mem, const Ui64 ip) {
+    const Ui32 field_bits = word_bits_ / 2;
+    const Ui64 a = ReadBits(mem, ip, addr_bits_);
+    const Ui64 b = ReadBits(mem, ip + field_bits, addr_bits_);
+    Count(&reads_, ip, word_bits_);
+    Count(&reads_, a, word_bits_);
+    Count(&reads_, b, word_bits_);
+    Count(&writes_, a, word_bits_);
+    Track(ip);
+    Track(a);
+    Track(b);
+    return true;
+  }
+
+  void OnStep(const Ui64 ip, const Ui64 next_ip) {
+    const Ui64 fall_through = (ip + 3 * (word_bits_ / 2)) &
+      ((1ull << addr_bits_) - 1);
+    if (next_ip != fall_through) {
+      Count(&reads_, ip + word_bits_, addr_bits_);
+    }
+  }
+
+  void OnBulk(const Ui64, const Ui64) {
+  }
+
+  Ui64 BucketBits() const {
+    return bucket_bits_;
+  }
+
+  const std::vector<Ui64> &Reads() const {
+    return reads_;
+  }
+
+  const std::vector<Ui64> &Writes() const {
+    return writes_;
+  }
+
+  // Text: a header, the distance histogram and one
+  // "bucket bit_offset reads writes" line per bucket that was accessed.
+  void Save(const char *path) const {
+    std::ostringstream out;
+    Ui64 touched = 0;
+    for (size_t i = 0; i < reads_.size(); ++i) {
+      touched += (reads_[i] || writes_[i]) ? 1 : 0;
+    }
+    out << "# bucket_bits " << bucket_bits_ << "\n";
+    out << "# buckets_touched " << touched << " of " << reads_.size() << "\n";
+    out << "# distance_zero " << distances_[0] << "\n";
+    for (Si32 bin = 1; bin < kDistanceBins; ++bin) {
+      if (distances_[bin]) {
+        out << "# distance_log2 " << (bin - 1) << " " << distances_[bin] << "\n";
+      }
+    }
+    for (size_t i = 0; i < reads_.size(); ++i) {
+      if (reads_[i] || writes_[i]) {
+        out << i << " " << i * bucket_bits_ << " " << reads_[i] << " "
+          << writes_[i] << "\n";
+      }
+    }
+    const std::string text = out.str();
+    WriteFile(path, reinterpret_cast<const Ui8*>(text.data()), text.size());
+    *Log() << "Wrote the heatmap to " << path;
+  }
+
+ private:
+  void Count(std::vector<Ui64> *buckets, const Ui64 addr, const Ui32 width) {
+    const Ui64 first = addr / bucket_bits_;
+    const Ui64 last = (addr + width - 1) / bucket_bits_;
+    ++(*buckets)[first];
+    if (last != first) {
+      ++(*buckets)[last];
+    }
+  }
+
+  void Track(const Ui64 addr) {
+    const Ui64 distance = addr > last_addr_ ? addr - last_addr_ :
+      last_addr_ - addr;
+    Si32 bin = 0;
+    while ((distance >> bin) > 1) {
+      ++bin;
+    }
+    ++distances_[distance ? bin + 1 : 0];
+    last_addr_ = addr;
+  }
+
+  Ui32 addr_bits_;
+  Ui32 word_bits_;
+  Ui64 bucket_bits_;
+  std::vector<Ui64> reads_;
+  std::vector<Ui64> writes_;
+  Ui64 distances_[kDistanceBins];  // by floor(log2(distance)) + 1
+  Ui64 last_addr_ = 0;
+};
+
+class StepObserver {
+ public:
+  static constexpr bool kAllowBulk = true;
+
+  virtual ~StepObserver() {}
+  bool BeforeStep(const Ui64 * const, const Ui64) {
+    return true;
+  }
+  // An interpreted instruction at ip.
+  virtual void OnStep(const Ui64 ip, const Ui64 next_ip) = 0;
+  // Instructions executed in bulk, ending at the loop head.
+  virtual void OnBulk(const Ui64 head, const Ui64 count) = 0;
+};
+
+// A virtual machine instance: memory, instruction pointer and an engine
+// specialized for its memory configuration. Virtual calls happen once per
+// batch of instructions, never per instruction.
+class Machine {
+ public:
+  virtual ~Machine() {}
+  virtual Ui32 AddrBits() const = 0;
+  virtual Ui32 WordBits() const = 0;
+  // Executes count instructions.
+  virtual void Run(const Ui64 count) = 0;
+  // The number of instructions retired by loop acceleration so far.
+  virtual Ui64 BulkInstructions() const = 0;
+  // Executes one instruction with the reference interpreter. Returns true
+  // if it jumped and stores the address of the word it wrote.
+  virtual bool Step(Ui64 *out_written) = 0;
+  virtual std::unique_ptr<Machine> Clone() const = 0;
+  // Executes count instructions, reporting them to the observer.
+  virtual void RunObserved(const Ui64 count, StepObserver *observer) = 0;
+  // Executes up to count instructions, stops at breakpoints and watchpoints.
+  virtual void RunDebug(const Ui64 count, Debugger *debugger) = 0;
+  // Executes count instructions, counting memory accesses.
+  virtual void RunHeatmap(const Ui64 count, Heatmap *heatmap) = 0;
+
+  Ui64 RamSizeBits() const {
+    return 1ull << AddrBits();
+  }
+
+  std::vector<Ui64> ram;  // RamSizeBits() bits plus padding for unaligned reads
+  Ui64 ip = 0;
+};
+
+template <Ui32 kAddrBits, Ui32 kWordBits>
+class MachineImpl : public Machine {
+ public:
+  MachineImpl() {
+    ram.assign(((1ull << kAddrBits) >> 6) + 3, 0);
+  }
+
+  Ui32 AddrBits() const override {
+    return kAddrBits;
+  }
+
+  Ui32 WordBits() const override {
+    return kWordBits;
+  }
+
+  void Run(const Ui64 count) override {
+    ip = accelerator_.Run(ram.data(), ip, count);
+  }
+
+  Ui64 BulkInstructions() const override {
+    return accelerator_.BulkInstructions();
+  }
+
+  bool Step(Ui64 *out_written) override {
+    const Ui64 fall_through = (ip + 3 * (kWordBits / 2)) & ((1ull << kAddrBits) - 1);
+    *out_written = ReadRambits<kAddrBits>(ram.data(), ip);
+    ip = InterpretOne<kAddrBits, kWordBits>(ram.data(), ip);
+    return ip != fall_through;
+  }
+
+  void RunObserved(const Ui64 count, StepObserver *observer) override {
+    ip = accelerator_.Run(ram.data(), ip, count, *observer);
+  }
+
+  void RunDebug(const Ui64 count, Debugger *debugger) override {
+    ip = accelerator_.Run(ram.data(), ip, count, *debugger);
+  }
+
+  void RunHeatmap(const Ui64 count, Heatmap *heatmap) override {
+    ip = accelerator_.Run(ram.data(), ip, count, *heatmap);
+  }
+
+  std::unique_ptr<Machine> Clone() const override {
+    return std::unique_ptr<Machine>(new MachineImpl(*this));
+  }
+
+ private:
+  LoopAccelerator<kAddrBits, kWordBits> accelerator_;
+};
+
+struct MachineConfig {
+  Ui32 addr_bits;
+  Ui32 word_bits;
+  Machine *(*create)();
+};
+
+template <Ui32 kAddrBits, Ui32 kWordBits>
+Machine *CreateMachine() {
+  return new MachineImpl<kAddrBits, kWordBits>();
+}
+
+// Configurations the interpreter is instantiated for.
+constexpr MachineConfig g_machine_configs[] = {
+  {16, 32, CreateMachine<16, 32>},
+  {20, 52, CreateMachine<20, 52>},
+  {22, 52, CreateMachine<22, 52>},
+  {24, 52, CreateMachine<24, 52>},
+  {26, 52, CreateMachine<26, 52>},
+};
+
+// The assembler accepts the configurations listed in rom_format.h.
+constexpr bool IsRomConfigListed() {
+  if (sizeof(g_machine_configs) / sizeof(g_machine_configs[0]) !=
+      sizeof(kRomConfigs) / sizeof(kRomConfigs[0])) {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(kRomConfigs) / sizeof(kRomConfigs[0]); ++i) {
+    if (g_machine_configs[i].addr_bits != kRomConfigs[i].ram_bits ||
+        g_machine_configs[i].word_bits != kRomConfigs[i].word_bits) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(IsRomConfigListed(), "kRomConfigs must list g_machine_configs");
+
+// Returns nullptr if the configuration is not instantiated.
+std::unique_ptr<Machine> MakeMachine(const Ui32 addr_bits, const Ui32 word_bits) {
+  for (const MachineConfig &config : g_machine_configs) {
+    if (config.addr_bits == addr_bits && config.word_bits == word_bits) {
+      return std::unique_ptr<Machine>(config.create());
+    }
+  }
+  return nullptr;
+}
+
+// The memory size of the largest configuration, in bits.
+Ui64 MaxRamSizeBits() {
+  Ui32 addr_bits = 0;
+  for (const MachineConfig &config : g_machine_configs) {
+    addr_bits = std::max(addr_bits, config.addr_bits);
+  }
+  return 1ull << addr_bits;
+}
+
+// Returns the value that follows the flag on the command line or nullptr.
+// Index picks among several values that follow one flag.
+const char *FindFlag(const char *name, const Si32 index = 0) {
+  const Si32 argc = GetEngine()->GetArgc();
+  const char *const *argv = GetEngine()->GetArgv();
+  for (Si32 i = 1; i + 1 + index < argc; ++i) {
+    if (strcmp(argv[i], name) == 0) {
+      return argv[i + 1 + index];
+    }
+  }
+  return nullptr;
+}
+
+bool HasFlag(const char *name) {
+  const Si32 argc = GetEngine()->GetArgc();
+  const char *const *argv = GetEngine()->GetArgv();
+  for (Si32 i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Ui32 FlagU32(const char *name, const Ui32 default_value) {
+  const char *value = FindFlag(name);
+  return value ? static_cast<Ui32>(strtoul(value, nullptr, 10)) : default_value;
+}
+
+Ui64 HashRam(const std::vector<Ui64> &ram) {
+  Ui64 hash = 0xcbf29ce484222325ull;
+  for (const Ui64 word : ram) {
+    hash = (hash ^ word) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Lockstep checking.
+//
+// The reference interpreter runs on a copy of the machine, one instruction
+// at a time, as the engine reports its progress. They are compared on ip and
+// memory after every instruction (kCheckWrites), every taken jump
+// (kCheckBlocks) or every interval instructions (kCheckInterval), and in
+// all modes after every bulk execution and at the end of every Run.
+// Instructions are compared on the words the reference wrote, everything
+// else on a hash of the whole memory. On a mismatch both are replayed from
+// the last snapshot with shorter budgets to narrow down the first
+// instruction after which they differ.
+enum CheckMode {
+  kCheckOff = 0,
+  kCheckWrites,
+  kCheckBlocks,
+  kCheckInterval
+};
+
+class LockstepChecker : public StepObserver {
+ public:
+  LockstepChecker(Machine *machine, const CheckMode mode, const Ui64 interval)
+      : machine_(machine)
+      , mode_(mode)
+      , interval_(std::max(interval, static_cast<Ui64>(1))) {
+    reference_ = machine_->Clone();
+    TakeSnapshot();
+  }
+
+  // Executes count instructions on both, returns false on a mismatch.
+  bool Run(const Ui64 count) {
+    if (has_failed_) {
+      return false;
+    }
+    segments_.push_back(count);
+    machine_->RunObserved(count, this);
+    if (!has_failed_ && verified_ != since_snapshot_) {
+      Check(machine_->ip, true);
+    }
+    if (!has_failed_ && since_snapshot_ >= kSnapshotInterval) {
+      TakeSnapshot();
+    }
+    return !has_failed_;
+  }
+
+  void OnStep(const Ui64, const Ui64 next_ip) override {
+    if (has_failed_) {
+      return;
+    }
+    Ui64 addr = 0;
+    const bool is_jump = reference_->Step(&addr);
+    ++since_snapshot_;
+    if (mode_ == kCheckInterval) {
+      if (since_snapshot_ - verified_ >= interval_) {
+        Check(next_ip, true);
+      }
+      return;
+    }
+    written_.push_back(addr);
+    if (mode_ == kCheckWrites || is_jump) {
+      Check(next_ip, false);
+    }
+  }
+
+  void OnBulk(const Ui64 head, const Ui64 count) override {
+    if (has_failed_) {
+      return;
+    }
+    Ui64 addr = 0;
+    for (Ui64 i = 0; i < count; ++i) {
+      reference_->Step(&addr);
+    }
+    since_snapshot_ += count;
+    if (mode_ != kCheckInterval || since_snapshot_ - verified_ >= interval_) {
+      Check(head, true);
+    }
+  }
+
+  bool HasFailed() const {
+    return has_failed_;
+  }
+
+  const std::string &Report() const {
+    return report_;
+  }
+
+ private:
+  static constexpr Ui64 kSnapshotInterval = 1 << 20;
+
+  void TakeSnapshot() {
+    executed_ += since_snapshot_;
+    snapshot_ = machine_->Clone();
+    segments_.clear();
+    since_snapshot_ = 0;
+    verified_ = 0;
+  }
+
+  // Instructions before the last check ran on the interpreter or were
+  // checked in full, so a match on the written words means a full match.
+  void Check(const Ui64 engine_ip, const bool is_full) {
+    bool is_equal = engine_ip == reference_->ip;
+    if (is_full) {
+      is_equal = is_equal && HashRam(machine_->ram) == HashRam(reference_->ram);
+    } else {
+      const Ui64 word_bits = machine_->WordBits();
+      for (const Ui64 addr : written_) {
+        const Ui64 first = addr >> 6;
+        const Ui64 last = (addr + word_bits - 1) >> 6;
+        is_equal = is_equal &&
+          machine_->ram[first] == reference_->ram[first] &&
+          machine_->ram[last] == reference_->ram[last];
+      }
+    }
+    written_.clear();
+    if (is_equal) {
+      verified_ = since_snapshot_;
+    } else {
+      has_failed_ = true;
+      Locate(engine_ip);
+    }
+  }
+
+  // Replays the engine from the snapshot with the same batches, cut to
+  // count instructions.
+  std::unique_ptr<Machine> ReplayEngine(const Ui64 count) const {
+    std::unique_ptr<Machine> machine = snapshot_->Clone();
+    Ui64 left = count;
+    for (const Ui64 length : segments_) {
+      if (!left) {
+        break;
+      }
+      const Ui64 step = std::min(length, left);
+      machine->Run(step);
+      left -= step;
+    }
+    return machine;
+  }
+
+  std::unique_ptr<Machine> ReplayReference(const Ui64 count) const {
+    std::unique_ptr<Machine> machine = snapshot_->Clone();
+    Ui64 addr = 0;
+    for (Ui64 i = 0; i < count; ++i) {
+      machine->Step(&addr);
+    }
+    return machine;
+  }
+
+  static bool IsEqual(const Machine &a, const Machine &b) {
+    return a.ip == b.ip && a.ram == b.ram;
+  }
+
+  // The mismatch happened after instruction verified_. Bisecting works only
+  // if the replay with a shorter budget still goes wrong; a difference may
+  // also be overwritten later, so this finds a point where the two start to
+  // differ, not necessarily the only one.
+  void Locate(const Ui64 engine_ip) {
+    Ui64 lo = verified_;
+    Ui64 hi = since_snapshot_;
+    Ui64 ip = engine_ip;
+    Ui64 reference_ip = reference_->ip;
+    const std::vector<Ui64> *engine_ram = &machine_->ram;
+    const std::vector<Ui64> *reference_ram = &reference_->ram;
+    std::unique_ptr<Machine> engine = ReplayEngine(hi);
+    std::unique_ptr<Machine> reference = ReplayReference(hi);
+    if (hi - lo > 1 && !IsEqual(*engine, *reference)) {
+      while (hi - lo > 1) {
+        const Ui64 mid = lo + (hi - lo) / 2;
+        if (IsEqual(*ReplayEngine(mid), *ReplayReference(mid))) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
+      }
+      engine = ReplayEngine(hi);
+      reference = ReplayReference(hi);
+      ip = engine->ip;
+      reference_ip = reference->ip;
+      engine_ram = &engine->ram;
+      reference_ram = &reference->ram;
+    }
+    const Ui64 start_ip = ReplayReference(lo)->ip;
+    Ui64 qword = 0;
+    while (qword + 1 < reference_ram->size() &&
+        (*engine_ram)[qword] == (*reference_ram)[qword]) {
+      ++qword;
+    }
+    char range[64] = "";
+    if (hi - lo > 1) {
+      snprintf(range, sizeof(range), "..%llu",
+          static_cast<unsigned long long>(executed_ + hi));
+    }
+    char text[512];
+    snprintf(text, sizeof(text),
+        "Lockstep mismatch at instruction %llu%s, ip %llu: "
+        "next ip %llu (reference %llu), memory bits %llu..%llu are %016llx "
+        "(reference %016llx)",
+        static_cast<unsigned long long>(executed_ + lo + 1), range,
+        static_cast<unsigned long long>(start_ip),
+        static_cast<unsigned long long>(ip),
+        static_cast<unsigned long long>(reference_ip),
+        static_cast<unsigned long long>(qword * 64),
+        static_cast<unsigned long long>(qword * 64 + 63),
+        static_cast<unsigned long long>((*engine_ram)[qword]),
+        static_cast<unsigned long long>((*reference_ram)[qword]));
+    report_ = text;
+  }
+
+  Machine *machine_;
+  std::unique_ptr<Machine> reference_;
+  std::unique_ptr<Machine> snapshot_;
+  CheckMode mode_;
+  Ui64 interval_;
+  std::vector<Ui64> written_;  // by the reference since the last check
+  std::vector<Ui64> segments_;  // engine batches since the snapshot
+  Ui64 executed_ = 0;  // instructions before the snapshot
+  Ui64 since_snapshot_ = 0;
+  Ui64 verified_ = 0;  // instructions since the snapshot known to match
+  bool has_failed_ = false;
+  std::string report_;
+};
+
+// Parses "writes", "blocks" or an instruction interval.
+CheckMode ParseCheckMode(const char *text, Ui64 *out_interval) {
+  *out_interval = 0;
+  if (!text) {
+    return kCheckOff;
+  }
+  if (strcmp(text, "writes") == 0) {
+    return kCheckWrites;
+  }
+  if (strcmp(text, "blocks") == 0) {
+    return kCheckBlocks;
+  }
+  *out_interval = strtoull(text, nullptr, 10);
+  return *out_interval ? kCheckInterval : kCheckOff;
+}
+
+// Fills memory with a random program. Most operands point into the program
+// itself, at field boundaries or between them, so it keeps patching its own
+// code; the rest are small counters and values that are negative as words.
+void GenerateFuzzRom(Machine *machine, const Ui64 seed) {
+  std::mt19937_64 random(seed);
+  const Ui32 field_bits = machine->WordBits() / 2;
+  const Ui64 field_mask = (1ull << field_bits) - 1;
+  const Ui64 fields = 8 + random() % 600;
+  for (Ui64 i = 0; i < fields; ++i) {
+    Ui64 value;
+    switch (random() % 8) {
+      case 0:
+      case 1:
+        value = random() % 64;
+        break;
+      case 2:
+        value = field_mask - random() % 64;
+        break;
+      case 3:
+        value = (random() % fields) * field_bits + random() % field_bits;
+        break;
+      default:
+        value = (random() % fields) * field_bits;
+        break;
+    }
+    WriteBits(machine->ram.data(), i * field_bits, field_bits,
+        value & field_mask);
+  }
+}
+
+// Runs random programs under the lockstep checker in uneven batches, so
+// that bulk execution gets cut at different places. Returns the number of
+// programs that failed.
+Ui32 RunFuzzer(const Ui32 addr_bits, const Ui32 word_bits,
+    const CheckMode mode, const Ui64 interval, const Ui64 first_seed,
+    const Ui32 count, const Ui64 instructions) {
+  Ui32 failures = 0;
+  for (Ui64 seed = first_seed; seed < first_seed + count; ++seed) {
+    std::unique_ptr<Machine> machine = MakeMachine(addr_bits, word_bits);
+    GenerateFuzzRom(machine.get(), seed);
+    LockstepChecker checker(machine.get(), mode, interval);
+    std::mt19937_64 random(~seed);
+    Ui64 done = 0;
+    while (done < instructions && !checker.HasFailed()) {
+      const Ui64 batch = std::min(1 + random() % 20000, instructions - done);
+      checker.Run(batch);
+      done += batch;
+    }
+    if (checker.HasFailed()) {
+      *Log() << "Fuzz seed " << seed << ": " << checker.Report();
+      ++failures;
+    }
+  }
+  *Log() << "Fuzzed " << count << " programs, " << failures << " failed";
+  return failures;
+}
+
+struct Rom {
+  std::vector<Ui8> data;
+  RomHeader header;
+  std::vector<RomSection> sections;
+};
+
+// Decompresses exactly out_size bytes, returns false on malformed input.
+bool DecompressLz(const Ui8 *in, const Ui64 in_size, Ui8 *out,
+    const Ui64 out_size) {
+  Ui64 in_pos = 0;
+  Ui64 out_pos = 0;
+  auto read_count = [&](Ui64 count, Ui64 *out_count) {
+    if (count == 15) {
+      Ui8 next = 255;
+      while (next == 255) {
+        if (in_pos >= in_size) {
+          return false;
+        }
+        next = in[in_pos++];
+        count += next;
+      }
+    }
+    *out_count = count;
+    return true;
+  };
+  while (in_pos < in_size) {
+    const Ui8 token = in[in_pos++];
+    Ui64 literals = 0;
+    if (!read_count(token >> 4, &literals) ||
+        literals > in_size - in_pos || literals > out_size - out_pos) {
+      return false;
+    }
+    memcpy(out + out_pos, in + in_pos, literals);
+    in_pos += literals;
+    out_pos += literals;
+    if (in_pos == in_size) {
+      break;
+    }
+    if (in_size - in_pos < 2) {
+      return false;
+    }
+    const Ui64 offset = in[in_pos] | (static_cast<Ui64>(in[in_pos + 1]) << 8);
+    in_pos += 2;
+    Ui64 match = 0;
+    if (!read_count(token & 15, &match)) {
+      return false;
+    }
+    match += 4;
+    if (offset == 0 || offset > out_pos || match > out_size - out_pos) {
+      return false;
+    }
+    for (Ui64 i = 0; i < match; ++i) {
+      out[out_pos + i] = out[out_pos + i - offset];
+    }
+    out_pos += match;
+  }
+  return out_pos == out_size;
+}
+
+// The whole of data as one raw section at 0, default configuration.
+void MakeFlatRom(Rom *rom) {
+  const Ui64 size = rom->data.size();
+  memcpy(rom->header.magic, kRomMagic, sizeof(kRomMagic));
+  rom->header.version = kRomVersion;
+  rom->header.header_size = 0;
+  rom->header.ram_bits = DEFAULT_RAM_BITS;
+  rom->header.word_bits = DEFAULT_WORD_BITS;
+  rom->header.entry_ip = 0;
+  rom->header.screen_bits[0] = 0;
+  rom->header.screen_bits[1] = g_screen_size.x * g_screen_size.y;
+  rom->header.section_count = 1;
+  rom->sections.assign(1, RomSection{0, 0, size, size, kSectionRaw, 0});
+}
+
+// Validates the ROM in rom->data. Files without the magic are flat. A broken
+// container is replaced by an empty ROM. Does not log, so it may run on
+// the reload thread.
+bool ParseRom(Rom *out_rom, string *out_error) {
+  Rom &rom = *out_rom;
+  rom.sections.clear();
+  const Ui64 size = rom.data.size();
+  if (size < sizeof(RomHeader) ||
+      memcmp(rom.data.data(), kRomMagic, sizeof(kRomMagic)) != 0) {
+    MakeFlatRom(&rom);
+    return true;
+  }
+  memcpy(&rom.header, rom.data.data(), sizeof(RomHeader));
+  const RomHeader &header = rom.header;
+  if (header.version != kRomVersion) {
+    *out_error = "Unsupported ROM version " + std::to_string(header.version);
+    rom.data.clear();
+    MakeFlatRom(&rom);
+    return false;
+  }
+  if (header.header_size < sizeof(RomHeader) || header.header_size > size ||
+      header.section_count > (size - header.header_size) / sizeof(RomSection)) {
+    *out_error = "Bad ROM header";
+    rom.data.clear();
+    MakeFlatRom(&rom);
+    return false;
+  }
+  rom.sections.resize(header.section_count);
+  if (header.section_count) {
+    memcpy(rom.sections.data(), rom.data.data() + header.header_size,
+        header.section_count * sizeof(RomSection));
+  }
+  // No memory holds more than this, so larger sections are corrupt.
+  const Ui64 max_section_size = MaxRamSizeBits() >> 3;
+  for (const RomSection &section : rom.sections) {
+    if (section.file_offset > size || section.stored_size > size - section.file_offset ||
+        section.size > max_section_size ||
+        (section.load_bits & 63) || section.encoding > kSectionLz ||
+        (section.encoding == kSectionRaw && section.stored_size != section.size)) {
+      *out_error = "Bad section";
+      rom.data.clear();
+      MakeFlatRom(&rom);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReadRom(const char *path, Rom *out_rom) {
+  out_rom->data = ReadFile(path, true);
+  *Log() << "Read " << out_rom->data.size() << " bytes from " << path;
+  string error;
+  if (!ParseRom(out_rom, &error)) {
+    *Log() << error << " in " << path;
+    return false;
+  }
+  return true;
+}
+
+// Memory is little-endian qwords, so on the little-endian hosts we build
+// for a section is a plain byte copy. Sections are cut at the memory end.
+// Returns false on a corrupt compressed section.
+bool LoadRom(const Rom &rom, Machine *machine) {
+  Ui8 *ram = reinterpret_cast<Ui8*>(machine->ram.data());
+  const Ui64 ram_size = machine->RamSizeBits() >> 3;
+  for (const RomSection &section : rom.sections) {
+    const Ui64 load = section.load_bits >> 3;
+    if (load >= ram_size) {
+      continue;
+    }
+    const Ui64 room = std::min(section.size, ram_size - load);
+    const Ui8 *data = rom.data.data() + section.file_offset;
+    if (section.encoding == kSectionRaw) {
+      memcpy(ram + load, data, room);
+    } else if (room == section.size) {
+      if (!DecompressLz(data, section.stored_size, ram + load, room)) {
+        return false;
+      }
+    } else {
+      std::vector<Ui8> buffer(section.size);
+      if (!DecompressLz(data, section.stored_size, buffer.data(), buffer.size())) {
+        return false;
+      }
+      memcpy(ram + load, buffer.data(), room);
+    }
+  }
+  machine->ip = rom.header.entry_ip & (machine->RamSizeBits() - 1);
+  return true;
+}
+
+// Matches between two programs. Each player runs in its own machine. The
+// shared region, qword aligned, is one memory for both: it is copied from
+// the player that ran to the other one at every switch. In every slice both
+// players run quota instructions, A first in even slices and B first in odd
+// ones, so a match only depends on the two ROMs and the configuration. It
+// ends after the slice in which a player's score word becomes nonzero or
+// after max_slices; the higher score wins.
+struct MatchConfig {
+  Ui32 addr_bits = DEFAULT_RAM_BITS;
+  Ui32 word_bits = DEFAULT_WORD_BITS;
+  Ui64 quota = 100000;
+  Ui64 max_slices = 1000;
+  Ui64 shared_bits = 0;
+  Ui64 shared_size_bits = 0;
+  Ui64 score_bits = 0;
+};
+
+struct MatchResult {
+  Si64 score[2] = {0, 0};
+  Ui64 slices = 0;
+  Si32 winner = -1;  // -1 for a draw
+};
+
+// Returns why the ROM, read with the given ReadRom result, cannot play a
+// match with the config, or an empty string if it can. Unless the machine
+// was picked on the command line, the ROM header has to agree with it.
+string CheckMatchRom(const Rom &rom, const bool is_read,
+    const MatchConfig &config, const bool is_header_checked) {
+  if (!is_read) {
+    return "Corrupt ROM";
+  }
+  if (rom.data.empty()) {
+    return "Missing or empty ROM";
+  }
+  if (is_header_checked && (rom.header.ram_bits != config.addr_bits ||
+      rom.header.word_bits != config.word_bits)) {
+    return "ROM needs " + std::to_string(rom.header.ram_bits) +
+      " address bits and " + std::to_string(rom.header.word_bits) +
+      " word bits";
+  }
+  return string();
+}
+
+class Match {
+ public:
+  Match(const MatchConfig &config, const Rom &rom_a, const Rom &rom_b)
+      : config_(config) {
+    const Rom *roms[2] = {&rom_a, &rom_b};
+    for (Si32 i = 0; i < 2; ++i) {
+      players_[i] = MakeMachine(config.addr_bits, config.word_bits);
+      if (!LoadRom(*roms[i], players_[i].get())) {
+        is_loaded_ = false;
+      }
+    }
+    // Player A's image of the shared region wins.
+    Share(0);
+  }
+
+  // False if a ROM had a corrupt section. Such a match does not run.
+  bool IsLoaded() const {
+    return is_loaded_;
+  }
+
+  // Runs one slice, returns false when the match is over.
+  bool Step() {
+    if (!is_loaded_ || IsOver()) {
+      return false;
+    }
+    const Si32 first = static_cast<Si32>(result_.slices & 1);
+    for (Si32 k = 0; k < 2; ++k) {
+      const Si32 player = first ^ k;
+      players_[player]->Run(config_.quota);
+      Share(player);
+    }
+    ++result_.slices;
+    for (Si32 i = 0; i < 2; ++i) {
+      result_.score[i] = Score(i);
+    }
+    if (IsOver()) {
+      result_.winner = result_.score[0] == result_.score[1] ? -1 :
+        (result_.score[0] > result_.score[1] ? 0 : 1);
+    }
+    return !IsOver();
+  }
+
+  bool IsOver() const {
+    return result_.slices >= config_.max_slices ||
+      result_.score[0] != 0 || result_.score[1] != 0;
+  }
+
+  const MatchResult &Result() const {
+    return result_;
+  }
+
+  const Machine &Player(const Si32 i) const {
+    return *players_[i];
+  }
+
+ private:
+  void Share(const Si32 from) {
+    const Ui64 begin = config_.shared_bits >> 6;
+    const Ui64 end = std::min((config_.shared_bits + config_.shared_size_bits) >> 6,
+        players_[0]->RamSizeBits() >> 6);
+    if (begin < end) {
+      memcpy(&players_[from ^ 1]->ram[begin], &players_[from]->ram[begin],
+          (end - begin) * sizeof(Ui64));
+    }
+  }
+
+  Si64 Score(const Si32 i) const {
+    const Ui32 word_bits = config_.word_bits;
+    const Ui64 value = ReadBits(players_[i]->ram.data(), config_.score_bits, word_bits);
+    return static_cast<Si64>(value << (64 - word_bits)) >> (64 - word_bits);
+  }
+
+  MatchConfig config_;
+  std::unique_ptr<Machine> players_[2];
+  MatchResult result_;
+  bool is_loaded_ = true;
+};
+
+// Runs the pairings listed in list_path, "rom_a rom_b" per line, on
+// thread_count threads. Every ROM is read once. Writes one line per match
+// in list order: index, both ROMs, both scores, winner and slices. A match
+// that cannot be played has "error" and the reason instead of the result.
+void RunTournament(const MatchConfig &config, const bool is_header_checked,
+    const char *list_path, const char *results_path, const Si32 thread_count) {
+  std::vector<Ui8> list = ReadFile(list_path, true);
+  std::istringstream in(std::string(list.begin(), list.end()));
+  std::vector<std::pair<std::string, std::string>> pairings;
+  std::map<std::string, Rom> roms;
+  std::map<std::string, string> rom_errors;
+  std::string rom_a;
+  std::string rom_b;
+  while (in >> rom_a >> rom_b) {
+    pairings.emplace_back(rom_a, rom_b);
+    for (const std::string &path : {rom_a, rom_b}) {
+      if (roms.find(path) == roms.end()) {
+        Rom &rom = roms[path];
+        const bool is_read = ReadRom(path.c_str(), &rom);
+        rom_errors[path] = CheckMatchRom(rom, is_read, config, is_header_checked);
+        if (!rom_errors[path].empty()) {
+          *Log() << rom_errors[path] << " in " << path;
+        }
+      }
+    }
+  }
+
+  std::vector<MatchResult> results(pairings.size());
+  std::vector<string> errors(pairings.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t idx = next++; idx < pairings.size(); idx = next++) {
+      const std::string &path_a = pairings[idx].first;
+      const std::string &path_b = pairings[idx].second;
+      if (!rom_errors.at(path_a).empty() || !rom_errors.at(path_b).empty()) {
+        errors[idx] = rom_errors.at(path_a).empty() ?
+          rom_errors.at(path_b) + " in " + path_b :
+          rom_errors.at(path_a) + " in " + path_a;
+        continue;
+      }
+      Match match(config, roms.at(path_a), roms.at(path_b));
+      if (!match.IsLoaded()) {
+        errors[idx] = "Corrupt section";
+        continue;
+      }
+      while (match.Step()) {
+      }
+      results[idx] = match.Result();
+    }
+  };
+  const double start_time = Time();
+  std::vector<std::thread> threads;
+  for (Si32 i = 0; i < std::max(thread_count, 1); ++i) {
+    threads.emplace_back(worker);
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  const double seconds = Time() - start_time;
+
+  std::ostringstream out;
+  size_t error_count = 0;
+  for (size_t idx = 0; idx < pairings.size(); ++idx) {
+    const MatchResult &result = results[idx];
+    out << idx << " " << pairings[idx].first << " " << pairings[idx].second;
+    if (!errors[idx].empty()) {
+      out << " error " << errors[idx] << "\n";
+      ++error_count;
+      continue;
+    }
+    out << " " << result.score[0] << " " << result.score[1] << " "
+      << result.winner << " " << result.slices << "\n";
+  }
+  const std::string text = out.str();
+  WriteFile(results_path, reinterpret_cast<const Ui8*>(text.data()), text.size());
+  *Log() << "Played " << pairings.size() - error_count << " matches on "
+    << threads.size() << " threads in " << seconds << " s, "
+    << (seconds > 0 ? (pairings.size() - error_count) / seconds : 0)
+    << " matches per second";
+  if (error_count) {
+    *Log() << error_count << " matches could not be played, see "
+      << results_path;
+  }
+}
+
+// Labels from the symbol file written by subleqasm, one "NAME address" per
+// line. Names are upper case, like the assembler sees them.
+class SymbolTable {
+ public:
+  void Load(const char *path) {
+    std::vector<Ui8> data = ReadFile(path, true);
+    std::istringstream in(std::string(data.begin(), data.end()));
+    std::string name;
+    Ui64 addr = 0;
+    while (in >> name >> addr) {
+      by_name_[name] = addr;
+      by_addr_.emplace_back(addr, name);
+    }
+    std::sort(by_addr_.begin(), by_addr_.end());
+    *Log() << "Read " << by_name_.size() << " symbols from " << path;
+  }
+
+  // Parses a number, a symbol or symbol+offset, symbol-offset.
+  bool Parse(const std::string &text, Ui64 *out_addr) const {
+    if (text.empty()) {
+      return false;
+    }
+    char *end = nullptr;
+    if (text[0] >= '0' && text[0] <= '9') {
+      *out_addr = strtoull(text.c_str(), &end, 0);
+      return *end == 0;
+    }
+    const size_t sign = text.find_first_of("+-");
+    std::string name = text.substr(0, sign);
+    std::transform(name.begin(), name.end(), name.begin(),
+        [](char c){ return ((c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c); });
+    auto it = by_name_.find(name);
+    if (it == by_name_.end()) {
+      return false;
+    }
+    Ui64 offset = 0;
+    if (sign != std::string::npos) {
+      offset = strtoull(text.c_str() + sign + 1, &end, 0);
+      if (*end != 0) {
+        return false;
+      }
+    }
+    *out_addr = text[sign == std::string::npos ? 0 : sign] == '-' ?
+      it->second - offset : it->second + offset;
+    return true;
+  }
+
+  // Returns "NAME+offset" for the closest symbol at or below addr.
+  std::string Describe(const Ui64 addr) const {
+    auto it = std::upper_bound(by_addr_.begin(), by_addr_.end(),
+        std::make_pair(addr, std::string("\x7f")));
+    std::ostringstream out;
+    out << addr;
+    if (it != by_addr_.begin()) {
+      --it;
+      out << " (" << it->second;
+      if (addr != it->first) {
+        out << "+" << (addr - it->first);
+      }
+      out << ")";
+    }
+    return out.str();
+  }
+
+ private:
+  std::unordered_map<std::string, Ui64> by_name_;
+  std::vector<std::pair<Ui64, std::string>> by_addr_;
+};
+
+// Runs up to count instructions, on the instrumented loop only if a
+// breakpoint or watchpoint is armed. Returns the number executed.
+Ui64 Execute(Machine *machine, Debugger *debugger, const Ui64 count) {
+  debugger->Resume();
+  Ui64 done = 0;
+  while (done < count && debugger->Reason() == Debugger::kStopNone) {
+    const Ui64 batch = std::min(count - done, static_cast<Ui64>(1 << 20));
+    if (debugger->IsArmed()) {
+      const Ui64 before = debugger->Executed();
+      machine->RunDebug(batch, debugger);
+      done += debugger->Executed() - before;
+    } else {
+      machine->Run(batch);
+      done += batch;
+    }
+  }
+  return done;
+}
+
+void PrintState(const Machine &machine, const Debugger &debugger,
+    const SymbolTable &symbols) {
+  const Ui32 field_bits = machine.WordBits() / 2;
+  if (debugger.Reason() == Debugger::kStopBreakpoint) {
+    std::cout << "Breakpoint" << std::endl;
+  } else if (debugger.Reason() == Debugger::kStopWatchpoint) {
+    std::cout << "Watchpoint: ip " << symbols.Describe(debugger.WriterIp())
+      << " wrote " << symbols.Describe(debugger.WrittenAddr()) << std::endl;
+  }
+  std::cout << "ip " << symbols.Describe(machine.ip) << ": SUBLEQ";
+  for (Ui32 k = 0; k < 3; ++k) {
+    std::cout << (k ? ", " : " ") << symbols.Describe(
+        ReadBits(machine.ram.data(), machine.ip + k * field_bits, field_bits));
+  }
+  std::cout << std::endl;
+}
+
+// Headless debugger reading commands from stdin. Addresses are bit offsets,
+// symbols or symbol+offset.
+//   break <addr>, delete <addr>       breakpoint on an instruction
+//   watch <addr> [bits], unwatch <addr>  stop after writes to the bits
+//   step [n], run [n], continue
+//   print <addr> [words], ip, info, quit
+void RunDebugger(Machine *machine, const SymbolTable &symbols) {
+  Debugger debugger(machine->AddrBits(), machine->WordBits());
+  const Ui32 word_bits = machine->WordBits();
+  std::string line;
+  while (std::cout << "> " << std::flush, std::getline(std::cin, line)) {
+    std::istringstream in(line);
+    std::vector<std::string> args;
+    for (std::string word; in >> word; ) {
+      args.push_back(word);
+    }
+    if (args.empty()) {
+      continue;
+    }
+    const std::string &command = args[0];
+    const std::string arg = args.size() > 1 ? args[1] : std::string();
+    Ui64 addr = 0;
+    const bool has_addr = symbols.Parse(arg, &addr);
+    // The count follows the address, step and run take it alone.
+    auto count_at = [&args](const size_t index, const Ui64 default_count) {
+      return index < args.size() ?
+        strtoull(args[index].c_str(), nullptr, 0) : default_count;
+    };
+    const Ui64 ram_bits = machine->RamSizeBits();
+    auto is_in_ram = [ram_bits](const Ui64 at, const Ui64 bits) {
+      return bits && at < ram_bits && ram_bits - at >= bits;
+    };
+    if (command == "quit" || command == "q") {
+      break;
+    } else if (command == "break" || command == "b") {
+      if (!has_addr) {
+        std::cout << "Unknown address " << arg << std::endl;
+        continue;
+      }
+      if (!is_in_ram(addr, 1)) {
+        std::cout << "Out of memory range" << std::endl;
+        continue;
+      }
+      debugger.AddBreakpoint(addr);
+    } else if (command == "delete") {
+      if (!has_addr || !debugger.RemoveBreakpoint(addr)) {
+        std::cout << "No breakpoint at " << arg << std::endl;
+      }
+    } else if (command == "watch" || command == "w") {
+      if (!has_addr) {
+        std::cout << "Unknown address " << arg << std::endl;
+        continue;
+      }
+      const Ui64 bits = count_at(2, word_bits);
+      if (!is_in_ram(addr, bits)) {
+        std::cout << "Out of memory range" << std::endl;
+        continue;
+      }
+      debugger.AddWatchpoint(addr, addr + bits);
+    } else if (command == "unwatch") {
+      if (!has_addr || !debugger.RemoveWatchpoint(addr)) {
+        std::cout << "No watchpoint at " << arg << std::endl;
+      }
+    } else if (command == "step" || command == "s" ||
+        command == "run" || command == "continue" || command == "c") {
+      const bool is_unbounded = command == "continue" || command == "c";
+      if (is_unbounded && !debugger.IsArmed()) {
+        std::cout << "Nothing armed, use run <count>" << std::endl;
+        continue;
+      }
+      const Ui64 done = Execute(machine, &debugger,
+          is_unbounded ? ~0ull : count_at(1, 1));
+      std::cout << done << " instructions" << std::endl;
+      PrintState(*machine, debugger, symbols);
+    } else if (command == "print" || command == "p") {
+      if (!has_addr) {
+        std::cout << "Unknown address " << arg << std::endl;
+        continue;
+      }
+      const Ui64 count = count_at(2, 1);
+      for (Ui64 i = 0; i < count; ++i) {
+        const Ui64 at = addr + i * word_bits;
+        if (!is_in_ram(at, word_bits)) {
+          std::cout << "Out of memory range" << std::endl;
+          break;
+        }
+        const Ui64 value = ReadBits(machine->ram.data(), at, word_bits);
+        const Si64 signed_value = static_cast<Si64>(value << (64 - word_bits)) >>
+          (64 - word_bits);
+        std::cout << symbols.Describe(at) << ": " << signed_value << std::endl;
+      }
+    } else if (command == "ip") {
+      PrintState(*machine, debugger, symbols);
+    } else if (command == "info") {
+      for (const Ui64 breakpoint : debugger.Breakpoints()) {
+        std::cout << "break " << symbols.Describe(breakpoint) << std::endl;
+      }
+      for (const Debugger::Watchpoint &watchpoint : debugger.Watchpoints()) {
+        std::cout << "watch " << symbols.Describe(watchpoint.begin) << " "
+          << (watchpoint.end - watchpoint.begin) << " bits" << std::endl;
+      }
+      std::cout << debugger.Executed() << " instructions traced" << std::endl;
+    } else {
+      std::cout << "Unknown command " << command << std::endl;
+    }
+  }
+}
+
 void DrawDisplays() {
   Sprite back = GetEngine()->GetBackbuffer();
   DrawRectangle(Vec2Si32(0, 0),
@@ -102,7 +2101,7 @@ void DrawDisplays() {
                 g_gray);
 }
 
-void DrawScreen(Ui64* mem, Vec2Si32 pos) {
+void DrawScreen(const Ui64* mem, Vec2Si32 pos) {
   Sprite back = GetEngine()->GetBackbuffer();
   Rgba* prgba = back.RgbaData();
   Si32 stride = back.StridePixels();
@@ -118,35 +2117,426 @@ void DrawScreen(Ui64* mem, Vec2Si32 pos) {
   }
 }
 
-void EasyMain() {
+// Buckets are spread over the strip width, brightness is logarithmic.
+void DrawHeatStrip(const std::vector<Ui64> &buckets, const Vec2Si32 pos,
+    const Vec2Si32 size) {
+  Sprite back = GetEngine()->GetBackbuffer();
+  Rgba* prgba = back.RgbaData();
+  Si32 stride = back.StridePixels();
+  const Ui64 count = buckets.size();
+  std::vector<Ui64> columns(size.x, 0);
+  Ui64 max_value = 1;
+  for (Si32 x = 0; x < size.x; ++x) {
+    const Ui64 begin = x * count / size.x;
+    const Ui64 end = std::max((x + 1) * count / size.x, begin + 1);
+    for (Ui64 i = begin; i < end && i < count; ++i) {
+      columns[x] += buckets[i];
+    }
+    max_value = std::max(max_value, columns[x]);
+  }
+  const double scale = 1.0 / std::log(1.0 + max_value);
+  for (Si32 x = 0; x < size.x; ++x) {
+    const double t = std::log(1.0 + columns[x]) * scale;
+    const Rgba color(static_cast<Ui8>(g_orange.r * t),
+        static_cast<Ui8>(g_orange.g * t), static_cast<Ui8>(g_orange.b * t), 255);
+    for (Si32 y = 0; y < size.y; ++y) {
+      prgba[pos.x + x + (pos.y + y) * stride] = color;
+    }
+  }
+}
+
+// Reads above writes, in the gray area below the screens.
+void DrawHeatmap(const Heatmap &heatmap) {
+  const Vec2Si32 size(g_screen_pos[1].x + g_screen_size.x - g_screen_pos[0].x, 32);
+  DrawHeatStrip(heatmap.Reads(), Vec2Si32(g_screen_pos[0].x, 56), size);
+  DrawHeatStrip(heatmap.Writes(), Vec2Si32(g_screen_pos[0].x, 16), size);
+}
+
+// Draws the screen at bit address screen_bits, black if it is not qword
+// aligned or does not fit in memory.
+void DrawMachineScreen(const Machine &machine, const Ui64 screen_bits,
+    const Vec2Si32 pos) {
+  const Ui64 screen_qw = (g_screen_size.x * g_screen_size.y) >> 6;
+  const Ui64 ram_qw = machine.RamSizeBits() >> 6;
+  const Ui64 at = screen_bits >> 6;
+  if (!(screen_bits & 63) && at <= ram_qw && ram_qw - at >= screen_qw) {
+    DrawScreen(&machine.ram[at], pos);
+  } else {
+    DrawRectangle(pos, pos + g_screen_size, g_black);
+  }
+}
+
+MatchConfig MatchConfigFromFlags(const Ui32 addr_bits, const Ui32 word_bits) {
+  MatchConfig config;
+  config.addr_bits = FlagU32("--ram-bits", addr_bits);
+  config.word_bits = FlagU32("--word-bits", word_bits);
+  config.quota = FlagU32("--quota", static_cast<Ui32>(config.quota));
+  config.max_slices = FlagU32("--max-slices", static_cast<Ui32>(config.max_slices));
+  const char *shared_bits = FindFlag("--shared", 0);
+  const char *shared_size_bits = FindFlag("--shared", 1);
+  if (shared_bits && shared_size_bits) {
+    config.shared_bits = strtoull(shared_bits, nullptr, 0);
+    config.shared_size_bits = strtoull(shared_size_bits, nullptr, 0);
+  }
+  // The last qword of memory by default.
+  config.score_bits = FlagU32("--score-addr",
+      static_cast<Ui32>((1ull << config.addr_bits) - 64));
+  return config;
+}
+
+// Plays one match, each player's first screen on its own display.
+void ShowMatch(const MatchConfig &config, const Rom &rom_a, const Rom &rom_b) {
   ResizeScreen(1920, 1080);
   ShowFrame();
   g_font.LoadLetterBits(g_tiny_font_letters, 6, 8);
 
-  for (size_t i = 0; i < RAM_SIZE_QW; ++i) {
-    ram[i] = 0;//Random64();
+  Match match(config, rom_a, rom_b);
+  if (!match.IsLoaded()) {
+    *Log() << "Corrupt section, the match does not run";
+    return;
   }
+  const Ui64 slices_per_frame = std::max(8*125000 / (2 * config.quota),
+      static_cast<Ui64>(1));
+  bool is_logged = false;
+  while (!IsAnyKeyDownward()) {
+    for (Ui64 i = 0; i < slices_per_frame && match.Step(); ++i) {
+    }
+    const MatchResult &result = match.Result();
+    if (match.IsOver() && !is_logged) {
+      *Log() << "Match over after " << result.slices << " slices, score "
+        << result.score[0] << ":" << result.score[1] << ", winner "
+        << result.winner;
+      is_logged = true;
+    }
 
-  std::vector<Ui8> source = ReadFile("data/rom.dat", true);
-  *Log() << "Read " << source.size() << " bytes from data/rom.dat";
-  Ui64 to_read = std::min((Ui64)source.size(), (Ui64)RAM_SIZE_BYTES);
-  for (Ui64 i = 0; i < to_read; ++i) {
-    ram[i >> 3] |= (Ui64(source[i]) << ((i & 7)*8));
+    DrawMachineScreen(match.Player(0), rom_a.header.screen_bits[0],
+        g_screen_pos[0]);
+    DrawMachineScreen(match.Player(1), rom_b.header.screen_bits[0],
+        g_screen_pos[1]);
+    DrawDisplays();
+
+    char text[1024];
+    snprintf(text, 1024, "Slice: %llu Score: %lld:%lld%s",
+        static_cast<unsigned long long>(result.slices),
+        static_cast<long long>(result.score[0]),
+        static_cast<long long>(result.score[1]),
+        match.IsOver() ? " Over" : "");
+    g_font.Draw(GetEngine()->GetBackbuffer(), text,
+                100, 100,
+                kTextOriginFirstBase,
+                kDrawBlendingModeColorize,
+                kFilterNearest,
+                Rgba(255,255,255,255));
+
+    ShowFrame();
+  }
+}
+
+// Hot reload of the ROM file. The file is polled by modification time and
+// size once per frame, which is a single stat call. A change is picked up
+// once the file looked the same on two polls in a row, so a ROM still
+// being written by the assembler is not loaded half way.
+class RomWatcher {
+ public:
+  explicit RomWatcher(const char *path)
+      : path_(path) {
+    last_ = Poll();
+    loaded_ = last_;
+  }
+
+  const string &Path() const {
+    return path_;
   }
 
+  bool HasChanged() {
+    const Stamp stamp = Poll();
+    const bool is_changed = stamp.is_present && stamp == last_ &&
+      !(stamp == loaded_);
+    last_ = stamp;
+    if (is_changed) {
+      loaded_ = stamp;
+    }
+    return is_changed;
+  }
+
+ private:
+  struct Stamp {
+    bool is_present = false;
+    Si64 mtime = 0;
+    Si64 mtime_ns = 0;
+    Ui64 size = 0;
+
+    bool operator==(const Stamp &other) const {
+      return is_present == other.is_present && mtime == other.mtime &&
+        mtime_ns == other.mtime_ns && size == other.size;
+    }
+  };
+
+  Stamp Poll() const {
+    Stamp stamp;
+    struct stat info;
+    if (stat(path_.c_str(), &info) == 0) {
+      stamp.is_present = true;
+      stamp.mtime = info.st_mtime;
+#if defined(__linux__)
+      stamp.mtime_ns = info.st_mtim.tv_nsec;
+#endif
+      stamp.size = info.st_size;
+    }
+    return stamp;
+  }
+
+  string path_;
+  Stamp last_;
+  Stamp loaded_;
+};
+
+// A ROM read, parsed and loaded into a fresh machine off the main thread.
+struct PreparedRom {
+  Rom rom;
+  std::unique_ptr<Machine> machine;
+  string error;
+};
+
+PreparedRom PrepareRom(const string path, const Ui32 forced_addr_bits,
+    const Ui32 forced_word_bits) {
+  PreparedRom prepared;
+  prepared.rom.data = ReadFile(path.c_str(), true);
+  // An empty file or the start of a header is a ROM still being written,
+  // loading it would reset the machine to nothing.
+  const std::vector<Ui8> &data = prepared.rom.data;
+  if (data.empty() || (data.size() < sizeof(RomHeader) &&
+      memcmp(data.data(), kRomMagic,
+        std::min(data.size(), sizeof(kRomMagic))) == 0)) {
+    prepared.error = "Truncated ROM";
+    return prepared;
+  }
+  if (!ParseRom(&prepared.rom, &prepared.error)) {
+    return prepared;
+  }
+  const Ui32 addr_bits = forced_addr_bits ? forced_addr_bits :
+    prepared.rom.header.ram_bits;
+  const Ui32 word_bits = forced_word_bits ? forced_word_bits :
+    prepared.rom.header.word_bits;
+  prepared.machine = MakeMachine(addr_bits, word_bits);
+  if (!prepared.machine) {
+    prepared.error = "No interpreter for " + std::to_string(addr_bits) +
+      " address bits and " + std::to_string(word_bits) + " word bits";
+  } else if (!LoadRom(prepared.rom, prepared.machine.get())) {
+    prepared.error = "Corrupt section";
+    prepared.machine.reset();
+  }
+  return prepared;
+}
+
+// Copies a bit range of the old memory over the new one, rounded out to
+// whole qwords. Ranges that do not fit both memories are skipped.
+void KeepRegion(const Machine &from, const Ui64 bit, const Ui64 bits,
+    Machine *to) {
+  const Ui64 first = bit >> 6;
+  const Ui64 end = (bit + bits + 63) >> 6;
+  if (bits == 0 || end > from.ram.size() || end > to->ram.size() ||
+      end < first) {
+    return;
+  }
+  std::copy(from.ram.begin() + first, from.ram.begin() + end,
+      to->ram.begin() + first);
+}
+
+void EasyMain() {
+  Rom rom;
+  ReadRom("data/rom.dat", &rom);
+  Ui32 addr_bits = FlagU32("--ram-bits", rom.header.ram_bits);
+  Ui32 word_bits = FlagU32("--word-bits", rom.header.word_bits);
+  std::unique_ptr<Machine> machine = MakeMachine(addr_bits, word_bits);
+  if (!machine) {
+    *Log() << "No interpreter for " << addr_bits << " address bits and "
+      << word_bits << " word bits, using the defaults";
+    addr_bits = DEFAULT_RAM_BITS;
+    word_bits = DEFAULT_WORD_BITS;
+    machine = MakeMachine(addr_bits, word_bits);
+  }
+
+  Ui64 check_interval = 0;
+  CheckMode check_mode = ParseCheckMode(FindFlag("--check"), &check_interval);
+  const Ui32 fuzz_count = FlagU32("--fuzz", 0);
+  if (fuzz_count) {
+    if (check_mode == kCheckOff) {
+      check_mode = kCheckBlocks;
+    }
+    RunFuzzer(addr_bits, word_bits, check_mode, check_interval,
+        FlagU32("--fuzz-seed", 1), fuzz_count,
+        FlagU32("--fuzz-instructions", 200000));
+    return;
+  }
+
+  const char *tournament_path = FindFlag("--tournament");
+  const char *match_a = FindFlag("--match", 0);
+  const char *match_b = FindFlag("--match", 1);
+  if (tournament_path || (match_a && match_b)) {
+    Rom rom_a;
+    Rom rom_b;
+    bool is_read_a = true;
+    bool is_read_b = true;
+    if (!tournament_path) {
+      is_read_a = ReadRom(match_a, &rom_a);
+      is_read_b = ReadRom(match_b, &rom_b);
+    }
+    // ROMs have to match the machine unless it is picked with flags.
+    const bool is_header_checked = !HasFlag("--ram-bits") &&
+      !HasFlag("--word-bits");
+    const MatchConfig config = tournament_path ?
+      MatchConfigFromFlags(DEFAULT_RAM_BITS, DEFAULT_WORD_BITS) :
+      MatchConfigFromFlags(rom_a.header.ram_bits, rom_a.header.word_bits);
+    if (!MakeMachine(config.addr_bits, config.word_bits)) {
+      *Log() << "No interpreter for " << config.addr_bits
+        << " address bits and " << config.word_bits << " word bits";
+      return;
+    }
+    if (tournament_path) {
+      const char *results_path = FindFlag("--match-results");
+      RunTournament(config, is_header_checked, tournament_path,
+          results_path ? results_path : "match_results.txt",
+          FlagU32("--threads", std::max(std::thread::hardware_concurrency(), 1u)));
+      return;
+    }
+    const string error_a = CheckMatchRom(rom_a, is_read_a, config,
+        is_header_checked);
+    const string error_b = CheckMatchRom(rom_b, is_read_b, config,
+        is_header_checked);
+    if (!error_a.empty() || !error_b.empty()) {
+      *Log() << (error_a.empty() ? error_b : error_a) << " in "
+        << (error_a.empty() ? match_b : match_a)
+        << ", the match does not run";
+      return;
+    }
+    ShowMatch(config, rom_a, rom_b);
+    return;
+  }
+
+  if (!LoadRom(rom, machine.get())) {
+    *Log() << "Corrupt section in data/rom.dat";
+  }
+
+  if (HasFlag("--debug")) {
+    SymbolTable symbols;
+    const char *symbols_path = FindFlag("--symbols");
+    symbols.Load(symbols_path ? symbols_path : "data/rom.sym");
+    RunDebugger(machine.get(), symbols);
+    return;
+  }
+
+  ResizeScreen(1920, 1080);
+  ShowFrame();
+  g_font.LoadLetterBits(g_tiny_font_letters, 6, 8);
+
   Ui64 ops = 0;
   double start_time = Time();
 
+  std::unique_ptr<LockstepChecker> checker;
+  if (check_mode != kCheckOff) {
+    checker.reset(new LockstepChecker(machine.get(), check_mode, check_interval));
+  }
+
+  // Granularity: word, qword or page (4 KiB of memory). The checker
+  // drives the machine itself, so the heatmap does not run with --check.
+  const char *heatmap_path = FindFlag("--heatmap");
+  bool is_heatmap_shown = HasFlag("--heatmap-overlay");
+  std::unique_ptr<Heatmap> heatmap;
+  if (checker && (heatmap_path || is_heatmap_shown)) {
+    *Log() << "The heatmap does not run with --check, ignoring it";
+    heatmap_path = nullptr;
+    is_heatmap_shown = false;
+  }
+  if (heatmap_path || is_heatmap_shown) {
+    const char *granularity = FindFlag("--heatmap-granularity");
+    Ui64 bucket_bits = 64;
+    if (granularity && strcmp(granularity, "word") == 0) {
+      bucket_bits = word_bits;
+    } else if (granularity && strcmp(granularity, "page") == 0) {
+      bucket_bits = 4096 * 8;
+    }
+    heatmap.reset(new Heatmap(addr_bits, word_bits, bucket_bits));
+  }
+
+  // --reload watches data/rom.dat. The new image is swapped in between
+  // batches, resetting the machine except for the screens with
+  // --reload-keep-screens and for the bit range given by
+  // --reload-keep <bit> <bits>.
+  std::unique_ptr<RomWatcher> watcher;
+  if (HasFlag("--reload")) {
+    watcher.reset(new RomWatcher("data/rom.dat"));
+  }
+  const Ui32 forced_addr_bits = FlagU32("--ram-bits", 0);
+  const Ui32 forced_word_bits = FlagU32("--word-bits", 0);
+  const bool is_screen_kept = HasFlag("--reload-keep-screens");
+  const char *keep_bit = FindFlag("--reload-keep", 0);
+  const char *keep_bits = FindFlag("--reload-keep", 1);
+  std::future<PreparedRom> reload;
+
   while (!IsAnyKeyDownward()) {
-    for (Si32 i = 0; i < 125000; ++i) {
-      ip_register = InterpretOne(ram, InterpretOne(ram, InterpretOne(ram, InterpretOne(ram,
-           InterpretOne(ram, InterpretOne(ram, InterpretOne(ram, InterpretOne(ram, ip_register))))))));
+    if (reload.valid() &&
+        reload.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+      PreparedRom prepared = reload.get();
+      if (!prepared.machine) {
+        *Log() << prepared.error << " in " << watcher->Path()
+          << ", keeping the running ROM";
+      } else {
+        Machine &next = *prepared.machine;
+        if (is_screen_kept) {
+          for (Si32 screen = 0; screen < 2; ++screen) {
+            if (rom.header.screen_bits[screen] ==
+                prepared.rom.header.screen_bits[screen]) {
+              KeepRegion(*machine, rom.header.screen_bits[screen],
+                  Ui64(g_screen_size.x) * g_screen_size.y, &next);
+            }
+          }
+        }
+        if (keep_bits) {
+          KeepRegion(*machine, strtoull(keep_bit, nullptr, 10),
+              strtoull(keep_bits, nullptr, 10), &next);
+        }
+        const bool is_resized = next.AddrBits() != addr_bits ||
+          next.WordBits() != word_bits;
+        addr_bits = next.AddrBits();
+        word_bits = next.WordBits();
+        machine = std::move(prepared.machine);
+        rom = std::move(prepared.rom);
+        if (checker) {
+          checker.reset(new LockstepChecker(machine.get(), check_mode,
+                check_interval));
+        }
+        if (heatmap && is_resized) {
+          heatmap.reset(new Heatmap(addr_bits, word_bits,
+                heatmap->BucketBits()));
+        }
+        *Log() << "Reloaded " << watcher->Path();
+      }
+    } else if (watcher && !reload.valid() && watcher->HasChanged()) {
+      reload = std::async(std::launch::async, PrepareRom, watcher->Path(),
+          forced_addr_bits, forced_word_bits);
+    }
+
+    if (checker) {
+      if (!checker->Run(8*125000)) {
+        *Log() << checker->Report();
+        checker.reset();
+      }
+    } else if (heatmap) {
+      machine->RunHeatmap(8*125000, heatmap.get());
+    } else {
+      machine->Run(8*125000);
     }
     ops += 8*125000;
 
-    DrawScreen(&ram[0*13689], g_screen_pos[0]);
-    DrawScreen(&ram[1*13689], g_screen_pos[1]);
+    for (Si32 screen = 0; screen < 2; ++screen) {
+      DrawMachineScreen(*machine, rom.header.screen_bits[screen],
+          g_screen_pos[screen]);
+    }
     DrawDisplays();
+    if (is_heatmap_shown) {
+      DrawHeatmap(*heatmap);
+    }
 
     double mhz = (ops / 1000000ull) / (Time() - start_time);
     char text[1024];
@@ -160,4 +2550,8 @@ void EasyMain() {
 
     ShowFrame();
   }
+
+  if (heatmap_path) {
+    heatmap->Save(heatmap_path);
+  }
 }